@@ -9,14 +9,42 @@
 #include <linux/fcntl.h>
 #include <linux/cdev.h>
 #include <linux/tty.h>
-#include <asm/atomic.h>
+#include <linux/atomic.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 #include <linux/cred.h>
-
-#include "scull.h"
+#include <linux/capability.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/srcu.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+
+#include "scull_05.h"
 
 static dev_t scull_a_firstdev;
+static int scull_a_nr_devs;   // 注册成功的设备数,0 表示 scull_access_init 失败或没有调用
+
+/*
+ * 只写打开时把设备截为 0.和 scull_open 一样持有 rwsem:
+ * trim 会换下目录并把旧数据交给后台释放,不能和读写并发
+ */
+static int scull_a_trim(struct scull_dev* dev , struct file* filp){
+    if( (filp->f_flags & O_ACCMODE) != O_WRONLY)
+        return 0;
+    if(down_write_killable(&dev->rwsem))
+        return -ERESTARTSYS;
+    scull_trim(dev);
+    up_write(&dev->rwsem);
+    return 0;
+}
 
+static struct scull_dev scull_s_device;
 static atomic_t scull_s_available = ATOMIC_INIT(1);
 
 /*******************************************************
@@ -24,36 +52,43 @@ static atomic_t scull_s_available = ATOMIC_INIT(1);
 *******************************************************/ 
 static int scull_s_open(struct inode* inode  , struct file* filp){
     struct scull_dev* dev = &scull_s_device; // 设备信息
+    int retval;
     if( !atomic_dec_and_test(&scull_s_available) ){
         atomic_inc(&scull_s_available);
         return -EBUSY;
     }
 
-    if( (filp->f_flags & O_ACCMODE) == O_WRONLY){
-        scull_trim(dev);
-    }
-
-    filp->private_data = dev;
-    return 0;
+    retval = scull_a_trim(dev , filp);
+    if(!retval)
+        retval = scull_file_open(filp , dev);
+    if(retval)
+        atomic_inc(&scull_s_available);
+    return retval;
 }
 
 static int scull_s_release(struct inode* inode,struct file* filp){
 
     atomic_inc(&scull_s_available);
-    return 0;
+    return scull_release(inode , filp);
 }
 
 /*******************************************************
  * 多进程并发访问,但每次只允许一个用户打开该设备
 *******************************************************/ 
+static struct scull_dev scull_u_device;
+static int scull_u_count;
+static kuid_t scull_u_owner;
+static DEFINE_SPINLOCK(scull_u_lock);
+
 static int scull_u_open(struct inode* inode  , struct file* filp){
-    struct scull_dev* dev = &scull_s_device; // 设备信息
+    struct scull_dev* dev = &scull_u_device; // 设备信息
+    int retval;
 
     spin_lock(&scull_u_lock);
 
     if(scull_u_count &&
-        (scull_u_owner != current->uid) && // 允许用户
-        (scull_u_owner != current->euid) && // 允许用户执行 su 命令的用户
+        !uid_eq(scull_u_owner , current_uid()) && // 允许用户
+        !uid_eq(scull_u_owner , current_euid()) && // 允许用户执行 su 命令的用户
         !capable(CAP_DAC_OVERRIDE)) // 也允许root用户
     {
   
@@ -63,27 +98,28 @@ static int scull_u_open(struct inode* inode  , struct file* filp){
     }
 
     if(scull_u_count == 0){
-        scull_u_owner = current->uid; // 获得所有者
+        scull_u_owner = current_uid(); // 获得所有者
     }
 
     scull_u_count++;    
     spin_unlock(&scull_u_lock);
 
-
-
-    if( (filp->f_flags & O_ACCMODE) == O_WRONLY){
-        scull_trim(dev);
+    retval = scull_a_trim(dev , filp);
+    if(!retval)
+        retval = scull_file_open(filp , dev);
+    if(retval){
+        spin_lock(&scull_u_lock);
+        scull_u_count --;
+        spin_unlock(&scull_u_lock);
     }
-
-    filp->private_data = dev;
-    return 0;
+    return retval;
 }
 
 static int scull_u_release(struct inode* inode , struct file*filp){
     spin_lock(&scull_u_lock);
     scull_u_count --;
     spin_unlock(&scull_u_lock);
-    return 0;
+    return scull_release(inode , filp);
 }
 
 
@@ -105,18 +141,21 @@ static inline int scull_w_available(void){
         capable(CAP_DAC_OVERRIDE);
 }
 
+static int scull_w_release(struct inode* inode , struct file* filp);
+
 static int scull_w_open(struct inode* inode , struct file* filp){
     struct scull_dev* dev = &scull_w_device;
+    int retval;
 
     spin_lock(&scull_w_lock);
 
     while(!scull_w_available()){
-        spin_unlock(&scull_w_lock());
+        spin_unlock(&scull_w_lock);
         if(filp->f_flags & O_NONBLOCK) 
             return -EAGAIN;
         
         // 加入阻塞队列
-        if(wait_event_interruptble(scull_w_wait , scull_w_available()))
+        if(wait_event_interruptible(scull_w_wait , scull_w_available()))
             return -ERESTARTSYS;
         spin_lock(&scull_w_lock);
     }
@@ -126,10 +165,15 @@ static int scull_w_open(struct inode* inode , struct file* filp){
     scull_w_count++;
     spin_unlock(&scull_w_lock);
 
-    if( (filp->f_flags & O_ACCMODE) == O_WRONLY)
-        scull_trim(dev);
-    filp->private_data = dev;
-    return 0;
+    // 失败时按一次 release 处理,让等待的进程有机会打开
+    retval = scull_a_trim(dev , filp);
+    if(!retval)
+        retval = scull_file_open(filp , dev);
+    if(retval){
+        filp->private_data = NULL;
+        scull_w_release(inode , filp);
+    }
+    return retval;
 }
 
 static int scull_w_release(struct inode* inode , struct file* filp){
@@ -146,7 +190,7 @@ static int scull_w_release(struct inode* inode , struct file* filp){
         wake_up_interruptible_sync(&scull_w_wait);
     }
 
-    return 0;
+    return scull_release(inode , filp);
 }
 
 /*******************************************************
@@ -156,24 +200,41 @@ static int scull_w_release(struct inode* inode , struct file* filp){
 struct scull_listitem{
     struct scull_dev device;
     dev_t key;
-    struct list_head list;
-}
+    struct hlist_node node;
+};
+
+/*
+ * 按 dev_t 散列的设备表.终端很多时线性查找链表让每次 open 都变慢,
+ * 散列之后查找只看一个桶,而且在 RCU 里进行,不拿锁,不会挡住其他终端.
+ * 设备只增不删,查到的指针在 RCU 临界区外也一直有效;
+ * scull_c_lock 只串行化插入
+ */
+#define SCULL_C_HASH_BITS 10
+static DEFINE_HASHTABLE(scull_c_hash , SCULL_C_HASH_BITS);
+static DEFINE_SPINLOCK(scull_c_lock);
+
+static struct scull_dev* scull_c_find(dev_t key){
+    struct scull_listitem* lptr;
 
-// 设备的链表,以及保护它的锁
-static LIST_HEAD(scull_c_list);
-static spinlock_t scull_c_lock = SPIN_LOCK_UNLOCKED;
+    hash_for_each_possible_rcu(scull_c_hash , lptr , node , key){
+        if(lptr->key == key)
+            return &(lptr->device);
+    }
+    return NULL;
+}
 
 // 查找设备,如果没有就创建一个
 static struct scull_dev* scull_c_lookfor_device(dev_t key){
     struct scull_listitem* lptr;
+    struct scull_dev* dev;
 
-    list_for_each_entry(lptr , &scull_c_list , list){
-        if(lptr->key == key){
-            return &list(lptr->device);
-        }
-    }
+    rcu_read_lock();
+    dev = scull_c_find(key);
+    rcu_read_unlock();
+    if(dev)
+        return dev;
 
-    // 没有找到,自己创建设备
+    // 没有找到,自己创建设备;分配和初始化可能睡眠,在锁外进行
     lptr = kmalloc(sizeof(struct scull_listitem) , GFP_KERNEL);
     if(!lptr){
         return NULL;
@@ -182,17 +243,33 @@ static struct scull_dev* scull_c_lookfor_device(dev_t key){
     //  初始化该设备
     memset(lptr , 0 , sizeof(struct scull_listitem));
     lptr->key = key;
+    if(scull_dev_init( &(lptr->device) )){
+        kfree(lptr);
+        return NULL;
+    }
     scull_trim( &(lptr->device) ); // 初始化
-    init_MUTEX( &(lptr->device.sem));
 
-    // 将其放入链表中
-    list_add(&lptr->list , &scull_c_list);
-    return &(lptr->device);
+    // 同一个终端上的两个进程可能同时走到这里,插入前在锁里再查一次
+    spin_lock(&scull_c_lock);
+    dev = scull_c_find(key);
+    if(!dev){
+        hash_add_rcu(scull_c_hash , &lptr->node , key);
+        dev = &(lptr->device);
+        lptr = NULL;
+    }
+    spin_unlock(&scull_c_lock);
+
+    if(lptr){
+        // 别人先插入了,用它的
+        scull_dev_destroy( &(lptr->device) );
+        kfree(lptr);
+    }
+    return dev;
 }
 
 static int scull_c_open(struct inode* inode , struct file* filp){
     struct scull_dev* dev;
-
+    int retval;
     dev_t key;
 
     if(!current->signal->tty){
@@ -202,37 +279,137 @@ static int scull_c_open(struct inode* inode , struct file* filp){
 
     key = tty_devnum(current->signal->tty);
 
-    // 在链表中查找 scullc 设备
-    spin_lock( &scull_c_lock);
+    // 在散列表中查找 scullc 设备,不需要加锁
     dev = scull_c_lookfor_device(key);
-    spin_unlock( &scull_c_lock );
 
     if(!dev)
         return -ENOMEM;
-    
 
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
-	filp->private_data = dev;
-	return 0;
+    retval = scull_a_trim(dev , filp);
+    if(retval)
+        return retval;
+	return scull_file_open(filp , dev);
 }
 
 static int scull_c_release(struct inode *inode, struct file *filp)
 {
     // 没有做太多特殊处理,最后关闭的时候释放设备,这个代码其实没有加一个打开设备的计数器
-	return 0;
+	return scull_release(inode , filp);
 }
 
 
-struct file_operations scull_priv_fops = {
-	.owner =    THIS_MODULE,
-	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
-	.unlocked_ioctl =    scull_ioctl,
-	.open =     scull_c_open,
-	.release =  scull_c_release,
+/*******************************************************
+ * 四个设备的文件操作只有 open/release 不同
+*******************************************************/
+#define SCULL_A_FOPS(name , open_fn , release_fn)          \
+static struct file_operations name = {                     \
+	.owner =    THIS_MODULE,                                 \
+	.llseek =   scull_llseek,                                \
+	.read_iter =  scull_read_iter,                           \
+	.write_iter = scull_write_iter,                          \
+	.unlocked_ioctl = scull_ioctl,                           \
+	.compat_ioctl =   compat_ptr_ioctl,                      \
+	.open =     open_fn,                                     \
+	.release =  release_fn,                                  \
+}
+
+SCULL_A_FOPS(scull_sngl_fops , scull_s_open , scull_s_release);
+SCULL_A_FOPS(scull_user_fops , scull_u_open , scull_u_release);
+SCULL_A_FOPS(scull_wusr_fops , scull_w_open , scull_w_release);
+SCULL_A_FOPS(scull_priv_fops , scull_c_open , scull_c_release);
+
+/*
+ * scullpriv 的数据在散列表的设备里,scull_c_device 只用来挂它的 cdev;
+ * 四个设备一样初始化,注册和清除的代码就不用区分
+ */
+static struct scull_dev scull_c_device;
+
+static struct scull_adev_info{
+    char* name;
+    struct scull_dev* sculldev;
+    struct file_operations* fops;
+} scull_access_devs[] = {
+    { "scullsingle" , &scull_s_device , &scull_sngl_fops },
+    { "sculluid"    , &scull_u_device , &scull_user_fops },
+    { "scullwuid"   , &scull_w_device , &scull_wusr_fops },
+    { "scullpriv"   , &scull_c_device , &scull_priv_fops },
 };
+#define SCULL_N_ADEVS ARRAY_SIZE(scull_access_devs)
+
+static int scull_access_setup(dev_t devno , struct scull_adev_info* devinfo){
+    struct scull_dev* dev = devinfo->sculldev;
+    int err;
+
+    // 第一次 trim 按模块参数确定几何参数
+    err = scull_dev_init(dev);
+    if(err)
+        return err;
+    scull_trim(dev);
+
+    cdev_init(&dev->cdev , devinfo->fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev , devno , 1);
+    if(err){
+        printk(KERN_NOTICE "Error %d adding %s\n", err, devinfo->name);
+        scull_dev_destroy(dev);
+    }
+    return err;
+}
 
+static void scull_access_release_dev(struct scull_dev* dev){
+    flush_work(&dev->reshape_work);
+    scull_trim(dev);
+    scull_dev_destroy(dev);
+}
+
+// 初始化访问控制设备,返回占用的设备号个数
+int scull_access_init(dev_t firstdev){
+    int result , i;
 
+    result = register_chrdev_region(firstdev , SCULL_N_ADEVS , "sculla");
+    if(result < 0){
+        printk(KERN_WARNING "sculla: device number registration failed\n");
+        return 0;
+    }
+    scull_a_firstdev = firstdev;
 
+    for(i = 0; i < SCULL_N_ADEVS; i++){
+        if(scull_access_setup(firstdev + i , scull_access_devs + i))
+            goto fail;
+    }
+    scull_a_nr_devs = SCULL_N_ADEVS;
+    return SCULL_N_ADEVS;
+
+  fail:
+    while(--i >= 0){
+        cdev_del(&scull_access_devs[i].sculldev->cdev);
+        scull_access_release_dev(scull_access_devs[i].sculldev);
+    }
+    unregister_chrdev_region(firstdev , SCULL_N_ADEVS);
+    return 0;
+}
+
+// 要在 scull_wq 销毁之前调用, trim 会把释放交给它
+void scull_access_cleanup(void){
+    struct scull_listitem* lptr;
+    struct hlist_node* next;
+    int i , bkt;
+
+    if(!scull_a_nr_devs)
+        return;
+
+    // 先删掉 cdev,之后不会再有 open,散列表也不会再增长
+    for(i = 0; i < scull_a_nr_devs; i++)
+        cdev_del(&scull_access_devs[i].sculldev->cdev);
+    for(i = 0; i < scull_a_nr_devs; i++)
+        scull_access_release_dev(scull_access_devs[i].sculldev);
+
+    hash_for_each_safe(scull_c_hash , bkt , next , lptr , node){
+        hash_del(&lptr->node);
+        scull_access_release_dev(&lptr->device);
+        kfree(lptr);
+    }
+
+    unregister_chrdev_region(scull_a_firstdev , SCULL_N_ADEVS);
+    scull_a_nr_devs = 0;
+}
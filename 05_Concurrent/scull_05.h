@@ -3,6 +3,15 @@
 #define _SCULL_05_H_
 
 #include <linux/ioctl.h> 
+#include <linux/types.h>
+#include <linux/version.h>
+
+#undef PDEBUG             /* undef it, just in case */
+#ifdef SCULL_DEBUG
+#  define PDEBUG(fmt, args...) printk( KERN_DEBUG "scull: " fmt, ## args)
+#else
+#  define PDEBUG(fmt, args...) /* not debugging: nothing */
+#endif
 
 #undef PDEBUGG
 #define PDEBUGG(fmt, args...) /* nothing: it's a placeholder */
@@ -19,6 +28,16 @@
 #define SCULL_P_NR_DEVS 4 // scullpipe0 -> scullpipe3
 #endif
 
+// 管道设备是一个环形缓冲区,这是它的默认大小
+#ifndef SCULL_P_BUFFER
+#define SCULL_P_BUFFER 4000
+#endif
+
+// SCULL_P_IOCTSIZE 允许的最大缓冲区
+#define SCULL_P_MAX_BUFFER (64 << 20)
+// 没有 CAP_SYS_RESOURCE 时的上限,和 pipe-max-size 的默认值一样
+#define SCULL_P_USER_BUFFER (1 << 20)
+
 /*
  * The bare device is a variable-length region of memory.
  * Use a linked list of indirect blocks.
@@ -36,6 +55,58 @@
 #define SCULL_QSET    1000
 #endif
 
+/*
+ * 量子集目录的组织方式
+ * SCULL_LAYOUT_LIST : 书上的单链表,定位第n个量子集需要 O(n) 次指针跳转
+ * SCULL_LAYOUT_INDEX: 用 xarray 按量子集编号索引,定位为 O(log n)
+ */
+#define SCULL_LAYOUT_LIST  0
+#define SCULL_LAYOUT_INDEX 1
+
+#ifndef SCULL_LAYOUT
+#define SCULL_LAYOUT SCULL_LAYOUT_INDEX
+#endif
+
+/*
+ * 量子的来源
+ * SCULL_BACKING_SLAB: 从本设备的 slab 分配,量子大小任意
+ * SCULL_BACKING_PAGE: 每个量子是 2^scull_page_order 页的复合页(quantum 固定为
+ *                     PAGE_SIZE << scull_page_order),设备可以被 mmap
+ */
+#define SCULL_BACKING_SLAB 0
+#define SCULL_BACKING_PAGE 1
+
+// 页面模式下量子最大 2MB,正好是 x86 上一个 PMD 大页
+#define SCULL_MAX_PAGE_ORDER (PAGE_SHIFT < 21 ? 21 - PAGE_SHIFT : 0)
+
+/*
+ * 设备的加锁方式
+ * SCULL_LOCK_EXCL  : 所有操作互斥,和书上的信号量一样
+ * SCULL_LOCK_RW    : 读者共享,写者独占
+ * SCULL_LOCK_STRIPE: 读写者都共享 rwsem,再按量子集编号分条加锁,
+ *                    不同量子集上的读写可以并行(trim 仍然独占)
+ * SCULL_LOCK_RCU   : 读者不加锁,只进入 SRCU 读端临界区;写者独占 rwsem,
+ *                    trim 摘下的量子集等宽限期过后才释放.适合一次写入、大量读者的场景
+ */
+#define SCULL_LOCK_EXCL   0
+#define SCULL_LOCK_RW     1
+#define SCULL_LOCK_STRIPE 2
+#define SCULL_LOCK_RCU    3
+
+/*
+ * 量子放在哪个 NUMA 节点上,只影响之后新分配的量子
+ * SCULL_NUMA_LOCAL     : 分配在第一次写入它的 CPU 所在的节点(内核的默认行为)
+ * SCULL_NUMA_BIND      : 全部分配在 numa_node 上
+ * SCULL_NUMA_INTERLEAVE: 在有内存的节点之间轮流分配
+ */
+#define SCULL_NUMA_LOCAL      0
+#define SCULL_NUMA_BIND       1
+#define SCULL_NUMA_INTERLEAVE 2
+
+#ifndef SCULL_NR_STRIPES
+#define SCULL_NR_STRIPES 16
+#endif
+
 
 /*
  * scull_qset 和 scull_dev 
@@ -43,35 +114,124 @@
  */
 struct scull_qset {
 	void **data; // 指向量子集(即很多很多量子)
-	struct scull_qset *next;
+	struct scull_qset *next; // 仅链表布局使用
 };
 
 // scull_dev用来表示设备
 struct scull_dev{
-    struct scull_qset *data; // 指向第一个量子集的指针
+    struct scull_qset *data; // 指向第一个量子集的指针(链表布局)
+    struct xarray* qsets;    // 量子集编号 -> scull_qset(索引布局),trim 时整个换掉
+    int layout;              // SCULL_LAYOUT_LIST 或 SCULL_LAYOUT_INDEX
+    int backing;             // SCULL_BACKING_SLAB 或 SCULL_BACKING_PAGE
     int quantum;             // 当前量子的大小
     int qset;                // 当前数组的大小 
     unsigned long size;      // 保存在其中的数据总量
     unsigned int access_key; // 由 sculluid 和 scullpriv 使用
-    struct semaphore sem;    // 互斥信号量
+    struct rw_semaphore rwsem; // 保护整个设备,trim 时写锁定
+    int lock_mode;             // SCULL_LOCK_*
+    struct rw_semaphore stripes[SCULL_NR_STRIPES]; // 分条锁,按量子集编号取模
+    struct mutex alloc_mutex;  // 串行化链表节点的追加
+    struct rw_semaphore fault_sem; // 缺页处理持有读锁,替换目录的 trim/reshape 持有写锁,见 scull_vma_fault
+    spinlock_t size_lock;      // 分条模式下保护 size
+    struct srcu_struct srcu;   // RCU 模式下的读端保护;读者会在 copy_to_user 中睡眠,所以用 SRCU
+    struct llist_head free_list;   // trim 摘下来、等待后台释放的量子集
+    struct work_struct free_work;  // 在 scull_wq 上分批释放 free_list
+    atomic_long_t nr_quanta;       // 当前数据占用的量子数
+    atomic_long_t pending_bytes;   // 已经 trim 但还没有释放的字节数
+    unsigned long generation;      // 每次 trim/reshape 加一,使各个打开文件缓存的游标失效
+
+    // 在线调整几何参数,见 SCULL_IOCRESHAPE
+    seqcount_t geom_seq;           // 几何参数和目录一起被替换时,无锁读者据此重新定位
+    int custom_geometry;           // 调整过以后 trim 不再恢复成全局默认值
+    unsigned long reshaping;       // 第 0 位: 有一次调整正在进行
+    int reshape_quantum , reshape_qset; // 调整的目标
+    loff_t reshape_lo , reshape_hi;     // 调整期间被写过的范围,交换之前重新拷贝
+    int reshape_status;            // 1: 进行中 0: 完成 <0: 失败的错误码
+    struct work_struct reshape_work;
     struct cdev cdev;        // 字符设备结构
+
+    /*
+     * 按本设备的 quantum/qset 建立的 slab,避免 kmalloc 把 4000 字节的量子取整到 4096
+     * 建立失败(或 scullpriv 这类动态设备)时为 NULL,退回到 kmalloc
+     */
+    struct kmem_cache* quantum_cache;
+    struct kmem_cache* qset_cache;
+    char quantum_cache_name[32];
+    char qset_cache_name[32];
+
+    // 预分配的量子池: 空闲量子串成单链表,链接指针就存放在量子的开头
+    void* pool;
+    int pool_count;
+    spinlock_t pool_lock;
+    // 分条模式下不同量子集的写者同时分配,计数不能借用 pool_lock
+    atomic_long_t pool_hits;   // 从预分配池拿到的量子数
+    atomic_long_t pool_misses; // 不得不向 slab 申请的量子数
+
+    int numa_policy;           // SCULL_NUMA_*
+    int numa_node;             // SCULL_NUMA_BIND 的目标节点
+    int numa_next;             // SCULL_NUMA_INTERLEAVE 上一次分配用的节点
+    atomic_long_t* node_bytes; // 每个节点上量子占用的字节数,nr_node_ids 个
+};
+
+
+/*
+ * 每次 open 分配一个,放在 filp->private_data 里
+ * 缓存上一次访问的 (量子集编号, 量子集指针),顺序读写时从这里继续,而不是重新从表头遍历
+ */
+struct scull_file {
+    struct scull_dev* dev;
+    spinlock_t lock;          // 同一个 file 可能被多个线程同时使用,保护下面三个成员
+    int item;                 // 游标所在的量子集编号
+    struct scull_qset* dptr;  // 游标所在的量子集
+    unsigned long generation; // 建立游标时设备的 generation
 };
 
+static inline struct scull_dev* scull_file_dev(struct file* filp){
+    return ((struct scull_file*)filp->private_data)->dev;
+}
+
 
 extern int scull_nr_devs;
 extern int scull_major;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_layout;
+extern int scull_pool_quanta;
+extern int scull_backing;
+extern int scull_page_order;
+extern int scull_numa_policy;
+extern int scull_numa_node;
+extern int scull_lock_mode;
+extern int scull_p_buffer; // scull_pipe_05.c
 
 
 int scull_open(struct inode *inode , struct file* filp);
+int scull_file_open(struct file* filp , struct scull_dev* dev);
 int scull_release(struct inode* inode , struct file* filp);
+int scull_dev_init(struct scull_dev* dev);
+void scull_dev_destroy(struct scull_dev* dev);
 int scull_trim(struct scull_dev* dev);
-ssize_t scull_read(struct file* filp , char __user *buf , size_t count, loff_t* f_pos);
-ssize_t scull_write(struct file* filp ,const char __user* buf, size_t count , loff_t* f_pos);
-struct scull_qset *scull_follow(struct scull_dev *dev, int n);
+ssize_t scull_read_iter(struct kiocb* iocb , struct iov_iter* to);
+ssize_t scull_write_iter(struct kiocb* iocb , struct iov_iter* from);
+struct scull_qset *scull_follow(struct scull_dev *dev, int n , gfp_t gfp);
+struct scull_qset *scull_lookup(struct scull_dev *dev, int n);
 long scull_ioctl(struct file* filp , unsigned int cmd , unsigned long arg);
 loff_t scull_llseek(struct file* filp, loff_t off , int where);
+int scull_mmap(struct file* filp , struct vm_area_struct* vma);
+struct pipe_inode_info;
+
+// 6.3 起 vma->vm_flags 是 const,只能通过 vm_flags_set 修改
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define scull_vm_flags_set(vma , flags) vm_flags_set(vma , flags)
+#else
+#define scull_vm_flags_set(vma , flags) ((vma)->vm_flags |= (flags))
+#endif
+ssize_t scull_splice_read(struct file* in , loff_t* ppos , struct pipe_inode_info* pipe , size_t len , unsigned int flags);
+
+int scull_p_init(dev_t dev);
+void scull_p_cleanup(void);
+int scull_access_init(dev_t dev);    // access.c
+void scull_access_cleanup(void);
 
 void scull_cleanup_module(void);
 
@@ -96,7 +256,152 @@ void scull_cleanup_module(void);
 #define SCULL_IOCHQUANTUM _IO(SCULL_IOC_MAGIC,  11)
 #define SCULL_IOCHQSET    _IO(SCULL_IOC_MAGIC,  12)
 
+/*
+ * 按设备调整几何参数: 已有的数据在后台按新的量子大小重新排布,不会丢失
+ * SCULL_IOCQRESHAPE 返回最近一次调整的状态: 1 进行中, 0 完成, 负数为错误码
+ */
+struct scull_geometry {
+    int quantum;
+    int qset;
+};
+
+#define SCULL_IOCRESHAPE  _IOW(SCULL_IOC_MAGIC, 15, struct scull_geometry)
+#define SCULL_IOCQRESHAPE _IO(SCULL_IOC_MAGIC,  16)
+
+// 按设备设置/读取 NUMA 策略,node 只对 SCULL_NUMA_BIND 有意义
+struct scull_numa {
+    int policy;
+    int node;
+};
+
+#define SCULL_IOCSNUMA    _IOW(SCULL_IOC_MAGIC, 17, struct scull_numa)
+#define SCULL_IOCGNUMA    _IOR(SCULL_IOC_MAGIC, 18, struct scull_numa)
+
+/*
+ * 一次取得设备的几何参数、大小和分配统计.
+ * 下面几个结构都只用定长的字段,32 位和 64 位的用户程序看到同样的布局
+ */
+struct scull_info {
+    __s32 quantum;
+    __s32 qset;
+    __s64 size;
+    __s64 nr_quanta;          // 数据占用的量子数
+    __s64 pending_bytes;      // trim 之后等待后台释放的字节数
+    __u64 pool_hits;
+    __u64 pool_misses;
+};
+
+/*
+ * 批量执行 ioctl: entries 中的每一项按顺序执行,每一项的返回值(失败时为负的错误码)写回 result,
+ * 一项失败不影响后面的项.其中的 SCULL_IOCINFO 共用开始时加一次设备锁取得的快照;
+ * 各项对用户内存的读写都不持有设备锁
+ */
+struct scull_ioc_entry {
+    __u32 cmd;
+    __u32 pad;
+    __u64 arg;               // 和 ioctl 的第三个参数一样,指针也放在这里
+    __s64 result;
+};
+
+struct scull_ioc_batch {
+    __u32 count;             // 最多 SCULL_IOC_BATCH_MAX 项
+    __u32 pad;
+    __u64 entries;           // struct scull_ioc_entry 数组的地址
+};
+
+#define SCULL_IOC_BATCH_MAX 64
+
+#define SCULL_IOCINFO     _IOR(SCULL_IOC_MAGIC,  19, struct scull_info)
+#define SCULL_IOCBATCH    _IOWR(SCULL_IOC_MAGIC, 20, struct scull_ioc_batch)
+
+/*
+ * scullpipe: 按设备调整环形缓冲区的大小(类似 F_SETPIPE_SZ),未读的数据会保留;
+ * 新的大小放不下未读数据时返回 -EBUSY.
+ * SCULL_P_IOCQSIZE 返回缓冲区大小, SCULL_P_IOCQUSED 返回缓冲区中未读的字节数
+ */
+#define SCULL_P_IOCTSIZE  _IO(SCULL_IOC_MAGIC,  13)
+#define SCULL_P_IOCQSIZE  _IO(SCULL_IOC_MAGIC,  14)
+#define SCULL_P_IOCQUSED  _IO(SCULL_IOC_MAGIC,  23)
+
+/*
+ * scullpipe: 读者的最小批量(类似 SO_RCVLOWAT),缓冲区里至少有这么多字节时才唤醒读者
+ * 写者关闭后剩下不足一批的数据也可以读走
+ */
+#define SCULL_P_IOCSLOWAT _IOW(SCULL_IOC_MAGIC, 21, int)
+#define SCULL_P_IOCGLOWAT _IOR(SCULL_IOC_MAGIC, 22, int)
+
+/*
+ * scullpipe 的 mmap: 第一页是 struct scull_p_ring,后面紧跟 size 字节的数据区,
+ * 映射的长度必须正好是 PAGE_SIZE + PAGE_ALIGN(size),偏移为 0;双方都要修改头部页,
+ * 需要以 O_RDWR 打开再用 MAP_SHARED 映射.
+ * 写者只修改 head,读者只修改 tail,都是数据区内的偏移;head == tail 为空,
+ * 总有一个字节空着.双方用 acquire 读对方的位置、用 release 发布自己的位置,
+ * 和 read()/write() 看到的是同一个环,可以混用.
+ * 生产者让环从空变成非空、消费者让环从满变成不满时,用 SCULL_P_IOCKICK 唤醒
+ * 阻塞在 read/write/poll 上的对方,其余时候不需要系统调用.映射期间不能调整大小
+ */
+struct scull_p_ring {
+    unsigned int head;            // 写入位置
+    unsigned int pad1[15];        // head 和 tail 不在同一个缓存行
+    unsigned int tail;            // 读取位置
+    unsigned int pad2[15];
+    unsigned int size;            // 数据区的大小,只读
+};
+
+#define SCULL_P_IOCKICK   _IO(SCULL_IOC_MAGIC,  24)
+
+/*
+ * scullpipe 的包模式(类似 O_DIRECT 管道): 每次 write 是一条记录,在环里存成
+ * 4 字节的长度头加数据,写入要么整条成功要么不写;一条记录放不进缓冲区时返回 -EMSGSIZE.
+ * 每次 read 返回一条记录的数据,count 不够时多出的部分丢弃;
+ * 同时设置 SCULL_P_PACKET_BATCH 时改为连同长度头返回尽可能多的完整记录,
+ * 第一条就放不下时返回 -EMSGSIZE,什么都不读走.
+ * 切换包模式时缓冲区必须为空,否则返回 -EBUSY
+ */
+#define SCULL_P_PACKET        1
+#define SCULL_P_PACKET_BATCH  2
+
+#define SCULL_P_IOCSPACKET _IOW(SCULL_IOC_MAGIC, 25, int)
+#define SCULL_P_IOCGPACKET _IOR(SCULL_IOC_MAGIC, 26, int)
+
+/*
+ * scullpipe 的分片模式,用于很多写者同时写一个设备: 每个 CPU 一个小环,
+ * 写者只锁自己所在 CPU 的那个,互不争用;每次 write 整条放进一个分片.
+ * 读者先读完共享的环,再从各个分片取记录: SCULL_P_SHARD_RR 轮流取,
+ * SCULL_P_SHARD_TS 按写入的时间合并.流模式下返回各条记录的数据拼在一起,
+ * 包模式下和共享的环一样按记录返回.
+ * 关闭时各个分片必须为空,否则返回 -EBUSY
+ */
+#define SCULL_P_SHARD_OFF  0
+#define SCULL_P_SHARD_RR   1
+#define SCULL_P_SHARD_TS   2
+
+#define SCULL_P_IOCSSHARD _IOW(SCULL_IOC_MAGIC, 27, int)
+#define SCULL_P_IOCGSHARD _IOR(SCULL_IOC_MAGIC, 28, int)
+
+/*
+ * scullpipe 的 SIGIO 合并,用于一连串小的写入(见 04_Debug 的 asynctest):
+ * SCULL_P_SIGIO_EVERY    每次写入都发一个信号,默认
+ * SCULL_P_SIGIO_EDGE     缓冲区从空变成可读时发一个;read() 读到空(或者返回 EAGAIN)、
+ *                        映射的读者读空后调用 SCULL_P_IOCKICK 时重新装上,
+ *                        所以信号处理函数要一直读到 EAGAIN
+ * SCULL_P_SIGIO_INTERVAL 两个信号之间至少隔 interval_ms 毫秒,
+ *                        间隔内的写入在间隔结束时合并成一个
+ * SCULL_P_IOCGSIGIO 同时在 suppressed 里返回被合并掉的信号数,SCULL_P_IOCSSIGIO 把它清零
+ */
+#define SCULL_P_SIGIO_EVERY     0
+#define SCULL_P_SIGIO_EDGE      1
+#define SCULL_P_SIGIO_INTERVAL  2
+
+struct scull_p_sigio {
+    __s32 mode;               // SCULL_P_SIGIO_*
+    __s32 interval_ms;        // 只用于 SCULL_P_SIGIO_INTERVAL
+    __u64 suppressed;         // 只读,定长的字段让 32 位程序看到同样的布局
+};
+
+#define SCULL_P_IOCSSIGIO _IOW(SCULL_IOC_MAGIC, 29, struct scull_p_sigio)
+#define SCULL_P_IOCGSIGIO _IOR(SCULL_IOC_MAGIC, 30, struct scull_p_sigio)
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 30
 
 #endif /* _SCULL_H_ */
\ No newline at end of file
@@ -0,0 +1,852 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/*
+ * scull 的性能测试
+ *
+ * seek 模式: 比较两种量子集目录布局的随机读性能
+ *   先向设备写入 size_mb MB 的数据,再分别在设备的开头和末尾做随机 pread,
+ *   输出每次读取的平均耗时.链表布局下末尾的读取会明显慢于开头,索引布局下两者相近.
+ *
+ *   insmod scull.ko scull_layout=0   # 链表布局
+ *   ./scull_bench /dev/scull0 256 100000
+ *   rmmod scull; insmod scull.ko scull_layout=1   # 索引布局
+ *   ./scull_bench /dev/scull0 256 100000
+ *
+ * mmap 模式: 比较 read() 和 mmap 顺序扫描整个设备的吞吐量(需要页面模式)
+ *   insmod scull.ko scull_backing=1
+ *   ./scull_bench /dev/scull0 256 0 mmap
+ *
+ * scale 模式: 1 到 N 个线程各自在设备的不同区域做 pread(scale-rw 时奇数线程改做 pwrite),
+ *   输出每个线程数下的总吞吐量,用来比较三种加锁方式
+ *   insmod scull.ko scull_lock_mode=2
+ *   ./scull_bench /dev/scull0 256 100000 scale 16
+ *
+ * seq 模式: 顺序写、顺序读整个设备的吞吐量,以及 trim 的耗时.
+ *   trim 分两部分: open(O_WRONLY) 本身,和后台把内存真正还给系统(/proc/scullmem 中
+ *   pending free 归零)所用的时间.用来比较 slab 量子和 2MB 复合页量子
+ *   insmod scull.ko scull_backing=0 scull_quantum=4000
+ *   ./scull_bench /dev/scull0 1024 0 seq
+ *   insmod scull.ko scull_backing=1 scull_page_order=9
+ *   ./scull_bench /dev/scull0 1024 0 seq
+ *
+ * splice 模式: 把设备的内容送到 /dev/null,比较 read()+write() 循环和 sendfile() 的吞吐量.
+ *   设备名里带 pipe 时测试 scullpipe: 另起一个线程不停地写入,两种方式各读 size_mb MB
+ *   insmod scull.ko scull_backing=1
+ *   ./scull_bench /dev/scull0 1024 0 splice
+ *   ./scull_bench /dev/scullpipe0 1024 0 splice
+ *
+ * spsc 模式: scullpipe 一读一写时的吞吐量(两个线程传输 size_mb MB),
+ *   以及经由 scullpipe0 和 scullpipe1 来回传递一个字节的往返延迟(nreads 次).
+ *   用来比较无锁的 SPSC 路径和加锁路径
+ *   insmod scull.ko scull_p_spsc=1
+ *   ./scull_bench /dev/scullpipe0 1024 100000 spsc
+ *   rmmod scull; insmod scull.ko scull_p_spsc=0
+ *   ./scull_bench /dev/scullpipe0 1024 100000 spsc
+ *
+ * herd 模式: nthreads 个读者(默认 64)阻塞在同一个 scullpipe 上,每次读 1 字节,
+ *   一个写者做 nreads 次 1 字节的写入.输出每次写入的耗时和平均上下文切换次数,
+ *   用来观察一次写入唤醒所有读者(惊群)的代价
+ *   ./scull_bench /dev/scullpipe0 0 100000 herd 64
+ *
+ * fanin 模式: 1 到 N 个写者线程各写 nreads 条 64 字节的记录,一个读者全部读走,
+ *   输出每个写者数下的总吞吐量.用来比较共享的环和每个 CPU 一个分片
+ *   insmod scull.ko scull_p_shard=0
+ *   ./scull_bench /dev/scullpipe0 0 100000 fanin 16
+ *   rmmod scull; insmod scull.ko scull_p_shard=1
+ *   ./scull_bench /dev/scullpipe0 0 100000 fanin 16
+ *
+ * sigio 模式: 子进程做 nreads 次 16 字节的写入,父进程像 asynctest 一样用 SIGIO 读取,
+ *   信号处理函数每次读到 EAGAIN 为止.输出每次写入收到的信号数和读者花掉的 CPU 时间,
+ *   用来比较每次写入都发信号和合并之后
+ *   insmod scull.ko scull_p_sigio=0
+ *   ./scull_bench /dev/scullpipe0 0 100000 sigio
+ *   rmmod scull; insmod scull.ko scull_p_sigio=1   # 或者 scull_p_sigio=2 scull_p_sigio_ms=1
+ *   ./scull_bench /dev/scullpipe0 0 100000 sigio
+ *
+ * uring 模式: 用 io_uring 以队列深度 depth 做 nops 次 4KB 随机读(depth 为第五个参数),
+ *   和同样次数的 pread 比较.需要 liburing:
+ *   gcc -O2 -DHAVE_LIBURING -o scull_bench scull_bench.c -lpthread -luring
+ *   ./scull_bench /dev/scull0 256 1000000 uring 128
+ */
+
+#define CHUNK 4096
+
+static char buffer[CHUNK];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 在 [base, base + span) 范围内随机读 nreads 次,返回每次读的平均纳秒数
+static double random_reads(int fd, off_t base, off_t span, long nreads)
+{
+    double t0, t1;
+    long i;
+    off_t off;
+
+    t0 = now();
+    for (i = 0; i < nreads; i++) {
+        off = base + (((off_t)rand() << 16 ^ rand()) % (span - 1));
+        if (pread(fd, buffer, 1, off) < 0) {
+            perror("pread");
+            exit(1);
+        }
+    }
+    t1 = now();
+    return (t1 - t0) * 1e9 / nreads;
+}
+
+static void fill_device(const char *path, off_t size)
+{
+    off_t done;
+    int fd;
+
+    // 以只写方式打开会先 trim 设备
+    fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    memset(buffer, 'x', CHUNK);
+    for (done = 0; done < size; ) {
+        ssize_t n = write(fd, buffer, CHUNK);
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        done += n;
+    }
+    close(fd);
+}
+
+// 用 1MB 的缓冲区 read() 整个设备 和 mmap 后逐页访问,分别输出 MB/s
+static void mmap_vs_read(int fd, off_t size)
+{
+    static char big[1 << 20];
+    volatile unsigned long sum = 0;
+    double t0, t1;
+    unsigned char *map;
+    off_t off;
+    ssize_t n;
+
+    t0 = now();
+    for (off = 0; off < size; off += n) {
+        n = pread(fd, big, sizeof(big), off);
+        if (n <= 0) {
+            perror("pread");
+            exit(1);
+        }
+        sum += big[0];
+    }
+    t1 = now();
+    printf("  read: %10.1f MB/s\n", size / (t1 - t0) / (1 << 20));
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    t0 = now();
+    for (off = 0; off < size; off += sizeof(long))
+        sum += *(unsigned long *)(map + off);
+    t1 = now();
+    printf("  mmap: %10.1f MB/s\n", size / (t1 - t0) / (1 << 20));
+    munmap(map, size);
+}
+
+// /proc/scullmem 中所有设备的 pending free 都为 0 时返回 1
+static int trim_settled(void)
+{
+    char line[256];
+    long pending;
+    int settled = 1;
+    char *p;
+    FILE *f = fopen("/proc/scullmem", "r");
+
+    if (!f)
+        return 1;
+    while (fgets(line, sizeof(line), f)) {
+        p = strstr(line, "pending free ");
+        if (p && sscanf(p, "pending free %ld", &pending) == 1 && pending)
+            settled = 0;
+    }
+    fclose(f);
+    return settled;
+}
+
+static void sequential(const char *path, off_t size)
+{
+    static char big[1 << 20];
+    double t0, t1, t2;
+    off_t off;
+    ssize_t n;
+    int fd;
+
+    t0 = now();
+    fill_device(path, size);
+    t1 = now();
+    printf("  write: %10.1f MB/s\n", size / (t1 - t0) / (1 << 20));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    t0 = now();
+    for (off = 0; off < size; off += n) {
+        n = pread(fd, big, sizeof(big), off);
+        if (n <= 0) {
+            perror("pread");
+            exit(1);
+        }
+    }
+    t1 = now();
+    close(fd);
+    printf("  read:  %10.1f MB/s\n", size / (t1 - t0) / (1 << 20));
+
+    t0 = now();
+    fd = open(path, O_WRONLY);
+    t1 = now();
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+    while (!trim_settled())
+        usleep(100);
+    t2 = now();
+    printf("  trim:  %10.1f us (open), %10.1f us (memory released)\n",
+           (t1 - t0) * 1e6, (t2 - t0) * 1e6);
+}
+
+struct feeder {
+    const char *path;
+    off_t size;
+    int rounds;
+};
+
+// scullpipe 的写者: rounds 轮测试各需要 size 字节
+static void *feeder_main(void *arg)
+{
+    struct feeder *f = arg;
+    char buf[CHUNK];
+    off_t done;
+    ssize_t n;
+    int fd = open(f->path, O_WRONLY);
+
+    if (fd < 0) {
+        perror(f->path);
+        exit(1);
+    }
+    memset(buf, 'p', sizeof(buf));
+    for (done = 0; done < f->rounds * f->size; done += n) {
+        n = write(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void splice_vs_read(const char *path, off_t size)
+{
+    static char big[1 << 20];
+    struct feeder f = { path, size, 2 };
+    pthread_t feeder;
+    int is_pipe = strstr(path, "pipe") != NULL;
+    double t0, t1;
+    off_t done, off = 0;
+    ssize_t n;
+    int fd, out;
+
+    out = open("/dev/null", O_WRONLY);
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || out < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (is_pipe)
+        pthread_create(&feeder, NULL, feeder_main, &f);
+    else
+        fill_device(path, size);
+
+    t0 = now();
+    for (done = 0; done < size; done += n) {
+        n = read(fd, big, is_pipe ? CHUNK : sizeof(big));
+        if (n <= 0 || write(out, big, n) != n) {
+            perror("read/write");
+            exit(1);
+        }
+    }
+    t1 = now();
+    printf("  read+write: %10.1f MB/s\n", size / (t1 - t0) / (1 << 20));
+
+    t0 = now();
+    for (done = 0; done < size; done += n) {
+        n = is_pipe ? sendfile(out, fd, NULL, 1 << 20) : sendfile(out, fd, &off, 1 << 20);
+        if (n <= 0) {
+            perror("sendfile");
+            exit(1);
+        }
+    }
+    t1 = now();
+    printf("  sendfile:   %10.1f MB/s\n", size / (t1 - t0) / (1 << 20));
+
+    if (is_pipe)
+        pthread_join(feeder, NULL);
+    close(fd);
+    close(out);
+}
+
+// 另一个 scullpipe 的名字: scullpipe0 <-> scullpipe1
+static void other_pipe(const char *path, char *out, size_t len)
+{
+    size_t n = strlen(path);
+
+    snprintf(out, len, "%s", path);
+    if (n > 0 && n < len)
+        out[n - 1] = out[n - 1] == '0' ? '1' : '0';
+}
+
+struct ponger {
+    const char *in, *out;
+    long nrounds;
+};
+
+// 回声线程: 从 in 读到一个字节就写回 out
+static void *pong_main(void *arg)
+{
+    struct ponger *p = arg;
+    int in = open(p->in, O_RDONLY);
+    int out = open(p->out, O_WRONLY);
+    long i;
+    char c;
+
+    if (in < 0 || out < 0) {
+        perror("pong open");
+        exit(1);
+    }
+    for (i = 0; i < p->nrounds; i++) {
+        if (read(in, &c, 1) != 1 || write(out, &c, 1) != 1) {
+            perror("pong");
+            exit(1);
+        }
+    }
+    close(in);
+    close(out);
+    return NULL;
+}
+
+/*
+ * 一读一写时 scullpipe 的吞吐量和往返延迟.
+ * 吞吐量: 一个线程写、一个线程读 size 字节;
+ * 延迟: 两个线程经由 scullpipe0/scullpipe1 互相传递一个字节 nrounds 次
+ */
+static void spsc(const char *path, off_t size, long nrounds)
+{
+    static char big[1 << 16];
+    struct feeder f = { path, size, 1 };
+    char path2[256];
+    struct ponger p;
+    pthread_t feeder, ponger;
+    double t0, t1;
+    off_t done;
+    ssize_t n;
+    long i;
+    int fd, in, out;
+    char c = 'x';
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    t0 = now();
+    pthread_create(&feeder, NULL, feeder_main, &f);
+    for (done = 0; done < size; done += n) {
+        n = read(fd, big, sizeof(big));
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+    }
+    t1 = now();
+    pthread_join(feeder, NULL);
+    close(fd);
+    printf("  throughput: %10.1f MB/s\n", size / (t1 - t0) / (1 << 20));
+
+    if (nrounds <= 0)
+        return;
+    other_pipe(path, path2, sizeof(path2));
+    p.in = path;
+    p.out = path2;
+    p.nrounds = nrounds;
+    pthread_create(&ponger, NULL, pong_main, &p);
+    out = open(path, O_WRONLY);
+    in = open(path2, O_RDONLY);
+    if (in < 0 || out < 0) {
+        perror(path2);
+        exit(1);
+    }
+    t0 = now();
+    for (i = 0; i < nrounds; i++) {
+        if (write(out, &c, 1) != 1 || read(in, &c, 1) != 1) {
+            perror("ping");
+            exit(1);
+        }
+    }
+    t1 = now();
+    pthread_join(ponger, NULL);
+    close(in);
+    close(out);
+    printf("  round trip: %10.1f ns\n", (t1 - t0) * 1e9 / nrounds);
+}
+
+// 惊群测试的读者: 读到 'q' 就退出
+static void *herd_main(void *arg)
+{
+    const char *path = arg;
+    int fd = open(path, O_RDONLY);
+    char c;
+
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    do {
+        if (read(fd, &c, 1) != 1) {
+            perror("read");
+            exit(1);
+        }
+    } while (c != 'q');
+    close(fd);
+    return NULL;
+}
+
+static void herd(const char *path, long nwrites, int nreaders)
+{
+    pthread_t *readers = calloc(nreaders, sizeof(*readers));
+    struct rusage r0, r1;
+    double t0, t1;
+    long i, csw;
+    int fd;
+
+    for (i = 0; i < nreaders; i++)
+        pthread_create(&readers[i], NULL, herd_main, (void *)path);
+    usleep(200000); // 等读者都睡下
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    getrusage(RUSAGE_SELF, &r0);
+    t0 = now();
+    for (i = 0; i < nwrites; i++) {
+        if (write(fd, "d", 1) != 1) {
+            perror("write");
+            exit(1);
+        }
+    }
+    // 每个读者一个结束标记
+    for (i = 0; i < nreaders; i++)
+        write(fd, "q", 1);
+    for (i = 0; i < nreaders; i++)
+        pthread_join(readers[i], NULL);
+    t1 = now();
+    getrusage(RUSAGE_SELF, &r1);
+    close(fd);
+    free(readers);
+
+    csw = (r1.ru_nvcsw - r0.ru_nvcsw) + (r1.ru_nivcsw - r0.ru_nivcsw);
+    printf("  %10.1f ns/write, %8.2f context switches/write\n",
+           (t1 - t0) * 1e9 / nwrites, (double)csw / nwrites);
+}
+
+static volatile sig_atomic_t sigio_fd, sigio_count;
+static volatile long sigio_bytes;
+
+static void sigio_handler(int signo)
+{
+    char buf[CHUNK];
+    ssize_t n;
+    int saved = errno;
+
+    (void)signo;
+    sigio_count++;
+    // 合并之后一个信号可能对应很多次写入,一直读到 EAGAIN
+    while ((n = read(sigio_fd, buf, sizeof(buf))) > 0)
+        sigio_bytes += n;
+    errno = saved;
+}
+
+static void sigio(const char *path, long nwrites)
+{
+    struct sigaction action;
+    struct rusage r0, r1;
+    long total = nwrites * 16, last = 0;
+    double t0, t1, cpu;
+    int fd, idle = 0;
+    pid_t child;
+
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    sigio_fd = fd;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigio_handler;
+    sigaction(SIGIO, &action, NULL);
+    fcntl(fd, F_SETOWN, getpid());
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | FASYNC);
+
+    getrusage(RUSAGE_SELF, &r0);
+    t0 = now();
+    child = fork();
+    if (child == 0) {
+        char rec[16];
+        int wfd = open(path, O_WRONLY);
+        long i;
+
+        if (wfd < 0) {
+            perror(path);
+            _exit(1);
+        }
+        memset(rec, 'd', sizeof(rec));
+        for (i = 0; i < nwrites; i++) {
+            if (write(wfd, rec, sizeof(rec)) != sizeof(rec)) {
+                perror("write");
+                _exit(1);
+            }
+        }
+        close(wfd);
+        _exit(0);
+    }
+
+    // 只靠信号读取;合并丢掉了最后一个通知时会停在这里
+    while (sigio_bytes < total) {
+        usleep(1000);
+        if (sigio_bytes == last && ++idle > 2000) {
+            printf("  stalled: %ld of %ld bytes read\n", (long)sigio_bytes, total);
+            break;
+        }
+        if (sigio_bytes != last)
+            idle = 0;
+        last = sigio_bytes;
+    }
+    t1 = now();
+    getrusage(RUSAGE_SELF, &r1);
+    waitpid(child, NULL, 0);
+    close(fd);
+
+    cpu = (r1.ru_utime.tv_sec - r0.ru_utime.tv_sec) + (r1.ru_utime.tv_usec - r0.ru_utime.tv_usec) * 1e-6
+        + (r1.ru_stime.tv_sec - r0.ru_stime.tv_sec) + (r1.ru_stime.tv_usec - r0.ru_stime.tv_usec) * 1e-6;
+    printf("  %8.3f signals/write, reader cpu %8.1f ms in %8.1f ms\n",
+           (double)sigio_count / nwrites, cpu * 1e3, (t1 - t0) * 1e3);
+}
+
+#define RECORD 64
+
+struct producer {
+    pthread_t thread;
+    const char *path;
+    long nrecords;
+};
+
+static void *producer_main(void *arg)
+{
+    struct producer *p = arg;
+    char rec[RECORD];
+    int fd = open(p->path, O_WRONLY);
+    long i;
+
+    if (fd < 0) {
+        perror(p->path);
+        exit(1);
+    }
+    memset(rec, 'r', sizeof(rec));
+    for (i = 0; i < p->nrecords; i++) {
+        if (write(fd, rec, sizeof(rec)) != sizeof(rec)) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+// 多个写者同时写一个 scullpipe,读者在主线程里读完所有数据
+static void fanin(const char *path, long nrecords, int maxproducers)
+{
+    static char big[1 << 16];
+    struct producer *p = calloc(maxproducers, sizeof(*p));
+    double t0, t1;
+    off_t total, done;
+    ssize_t n;
+    int fd, np, i;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    for (np = 1; np <= maxproducers; np *= 2) {
+        total = (off_t)np * nrecords * RECORD;
+        t0 = now();
+        for (i = 0; i < np; i++) {
+            p[i].path = path;
+            p[i].nrecords = nrecords;
+            pthread_create(&p[i].thread, NULL, producer_main, &p[i]);
+        }
+        for (done = 0; done < total; done += n) {
+            n = read(fd, big, sizeof(big));
+            if (n <= 0) {
+                perror("read");
+                exit(1);
+            }
+        }
+        for (i = 0; i < np; i++)
+            pthread_join(p[i].thread, NULL);
+        t1 = now();
+        printf("  %3d producers: %10.1f MB/s\n", np, total / (t1 - t0) / (1 << 20));
+    }
+    close(fd);
+    free(p);
+}
+
+#ifdef HAVE_LIBURING
+static off_t random_chunk(off_t size)
+{
+    return (((off_t)rand() << 16 ^ rand()) % (size / CHUNK)) * CHUNK;
+}
+
+static void uring_vs_pread(int fd, off_t size, long nops, int depth)
+{
+    static char bufs[1024][CHUNK];
+    struct io_uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    double t0, t1;
+    long submitted = 0, done = 0, i;
+
+    if (depth > 1024)
+        depth = 1024;
+
+    t0 = now();
+    for (i = 0; i < nops; i++) {
+        if (pread(fd, bufs[0], CHUNK, random_chunk(size)) < 0) {
+            perror("pread");
+            exit(1);
+        }
+    }
+    t1 = now();
+    printf("  pread:           %10.0f ops/s\n", nops / (t1 - t0));
+
+    if (io_uring_queue_init(depth, &ring, 0) < 0) {
+        perror("io_uring_queue_init");
+        exit(1);
+    }
+
+    // 始终保持 depth 个读请求在飞,每完成一个就补一个;读到的内容不检查,缓冲区重叠也无妨
+    t0 = now();
+    while (done < nops) {
+        while (submitted < nops && submitted - done < depth) {
+            sqe = io_uring_get_sqe(&ring);
+            if (!sqe)
+                break;
+            io_uring_prep_read(sqe, fd, bufs[submitted % depth], CHUNK, random_chunk(size));
+            submitted++;
+        }
+        io_uring_submit_and_wait(&ring, 1);
+        while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+            if (cqe->res < 0) {
+                fprintf(stderr, "read: %s\n", strerror(-cqe->res));
+                exit(1);
+            }
+            io_uring_cqe_seen(&ring, cqe);
+            done++;
+        }
+    }
+    t1 = now();
+    printf("  io_uring qd %4d: %10.0f ops/s\n", depth, nops / (t1 - t0));
+    io_uring_queue_exit(&ring);
+}
+#endif
+
+struct worker {
+    pthread_t thread;
+    int fd;
+    int write;
+    off_t base, span;
+    long nops;
+};
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    char buf[CHUNK];
+    unsigned int seed = (unsigned int)w->base;
+    off_t off;
+    long i;
+
+    memset(buf, 'y', sizeof(buf));
+    for (i = 0; i < w->nops; i++) {
+        off = w->base + (rand_r(&seed) % (w->span / CHUNK)) * CHUNK;
+        if (w->write)
+            pwrite(w->fd, buf, CHUNK, off);
+        else
+            pread(w->fd, buf, CHUNK, off);
+    }
+    return NULL;
+}
+
+// 每个线程负责设备上互不重叠的一段,这样不同线程大多落在不同的量子集上
+static void scale(int fd, off_t size, long nops, int maxthreads, int mixed)
+{
+    struct worker *w = calloc(maxthreads, sizeof(*w));
+    double t0, t1;
+    int n, i;
+
+    for (n = 1; n <= maxthreads; n++) {
+        t0 = now();
+        for (i = 0; i < n; i++) {
+            w[i].fd = fd;
+            w[i].write = mixed && (i & 1);
+            w[i].span = size / n;
+            w[i].base = w[i].span * i;
+            w[i].nops = nops;
+            pthread_create(&w[i].thread, NULL, worker_main, &w[i]);
+        }
+        for (i = 0; i < n; i++)
+            pthread_join(w[i].thread, NULL);
+        t1 = now();
+        printf("  %3d threads: %10.1f MB/s\n", n,
+               (double)n * nops * CHUNK / (t1 - t0) / (1 << 20));
+    }
+    free(w);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/dev/scull0";
+    long size_mb = 64, nreads = 10000;
+    const char *mode = "seek";
+    int nthreads = 8;
+    off_t size, span;
+    int fd;
+
+    if (argc > 1)
+        path = argv[1];
+    if (argc > 2)
+        size_mb = atol(argv[2]);
+    if (argc > 3)
+        nreads = atol(argv[3]);
+    if (argc > 4)
+        mode = argv[4];
+    if (argc > 5)
+        nthreads = atoi(argv[5]);
+
+    size = (off_t)size_mb << 20;
+    span = size / 100; // 开头和末尾各取 1%
+    if (span < 2)
+        span = 2;
+
+    if (strcmp(mode, "splice") == 0) {
+        printf("%s: %ld MB, read+write vs sendfile\n", path, size_mb);
+        splice_vs_read(path, size);
+        return 0;
+    }
+
+    if (strcmp(mode, "spsc") == 0) {
+        printf("%s: %ld MB, %ld round trips, one reader one writer\n", path, size_mb, nreads);
+        spsc(path, size, nreads);
+        return 0;
+    }
+
+    if (strcmp(mode, "fanin") == 0) {
+        printf("%s: %ld records of %d bytes per producer\n", path, nreads, RECORD);
+        fanin(path, nreads, nthreads);
+        return 0;
+    }
+
+    if (strcmp(mode, "herd") == 0) {
+        if (argc <= 5)
+            nthreads = 64;
+        printf("%s: %d blocked readers, %ld one-byte writes\n", path, nthreads, nreads);
+        herd(path, nreads, nthreads);
+        return 0;
+    }
+
+    if (strcmp(mode, "sigio") == 0) {
+        printf("%s: %ld writes of 16 bytes, SIGIO reader\n", path, nreads);
+        sigio(path, nreads);
+        return 0;
+    }
+
+    if (strcmp(mode, "seq") == 0) {
+        printf("%s: %ld MB, sequential\n", path, size_mb);
+        sequential(path, size);
+        return 0;
+    }
+
+    fill_device(path, size);
+
+    fd = open(path, strncmp(mode, "scale", 5) == 0 ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    if (strncmp(mode, "scale", 5) == 0) {
+        printf("%s: %ld MB, %ld ops per thread, %s\n", path, size_mb, nreads, mode);
+        scale(fd, size, nreads, nthreads, strcmp(mode, "scale-rw") == 0);
+        close(fd);
+        return 0;
+    }
+
+#ifdef HAVE_LIBURING
+    if (strcmp(mode, "uring") == 0) {
+        printf("%s: %ld MB, %ld random reads, pread vs io_uring\n", path, size_mb, nreads);
+        srand(1);
+        uring_vs_pread(fd, size, nreads, nthreads);
+        close(fd);
+        return 0;
+    }
+#endif
+
+    if (strcmp(mode, "mmap") == 0) {
+        printf("%s: %ld MB, read vs mmap\n", path, size_mb);
+        mmap_vs_read(fd, size);
+        close(fd);
+        return 0;
+    }
+
+    srand(1);
+    printf("%s: %ld MB, %ld reads\n", path, size_mb, nreads);
+    printf("  head: %10.1f ns/read\n", random_reads(fd, 0, span, nreads));
+    printf("  tail: %10.1f ns/read\n", random_reads(fd, size - span, span, nreads));
+    close(fd);
+    return 0;
+}
@@ -11,6 +11,18 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/uio.h>	/* iov_iter */
+#include <linux/mm.h>	/* alloc_page(), vm_operations_struct */
+#include <linux/rwsem.h>
+#include <linux/srcu.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/capability.h>
+#include <linux/nodemask.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
 
 #include <linux/uaccess.h>	/* copy_*_user */
 
@@ -27,27 +39,47 @@ int scull_minor = 0;
 int scull_nr_devs = SCULL_NR_DEVS;
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset    = SCULL_QSET;
+int scull_layout  = SCULL_LAYOUT; // 量子集目录布局,见 scull_05.h
+int scull_pool_quanta = 0;        // 每个设备预分配的量子数,0 表示不预分配
+int scull_backing = SCULL_BACKING_SLAB; // 量子的来源,见 scull_05.h
+int scull_page_order = 0;               // 页面模式下每个量子的阶数
+int scull_numa_policy = SCULL_NUMA_LOCAL; // 新设备的 NUMA 策略,见 scull_05.h
+int scull_numa_node = 0;                  // SCULL_NUMA_BIND 的节点
+int scull_lock_mode = SCULL_LOCK_EXCL;  // 设备的加锁方式,见 scull_05.h
 
 module_param(scull_major,int ,S_IRUGO);
 module_param(scull_minor,int ,S_IRUGO);
 module_param(scull_nr_devs,int ,S_IRUGO);
 module_param(scull_quantum,int ,S_IRUGO);
 module_param(scull_qset,int ,S_IRUGO);
+module_param(scull_layout,int ,S_IRUGO);
+module_param(scull_pool_quanta,int ,S_IRUGO);
+module_param(scull_backing,int ,S_IRUGO);
+module_param(scull_page_order,int ,S_IRUGO);
+module_param(scull_numa_policy,int ,S_IRUGO);
+module_param(scull_numa_node,int ,S_IRUGO);
+module_param(scull_lock_mode,int ,S_IRUGO);
 
 MODULE_AUTHOR("Liu Wenliang");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev* scull_devices;
 
+static struct workqueue_struct* scull_wq; // 后台释放 trim 掉的数据
+
 
 
 // 这次的scull设备驱动程序所实现的只是最重要的设备方法,下列的这些方法要被重新实现
 static struct file_operations scull_fops = {
     .owner  = THIS_MODULE,
     .llseek = scull_llseek, // 修改文件的当前读写位置
-    .read   = scull_read,   // 从设备读取文件
-    .write  = scull_write,  // 向设备发送数据
+    .read_iter  = scull_read_iter,  // 从设备读取文件,read/readv 都走这里
+    .write_iter = scull_write_iter, // 向设备发送数据,write/writev 都走这里
     .unlocked_ioctl  = scull_ioctl,  // 系统调用,提供了一种执行设备特定命令的方法
+    .compat_ioctl    = compat_ptr_ioctl, // 参数的布局和位数无关,32 位程序直接转过来
+    .mmap   = scull_mmap,   // 页面模式下把量子直接映射到用户空间
+    .splice_read  = scull_splice_read,      // sendfile/splice: 页面模式下把量子页直接挂进管道
+    .splice_write = iter_file_splice_write, // 管道 -> 量子,经 scull_write_iter 只拷贝一次
     .open   = scull_open,   // 打开文件，对设备文件执行的第一个操作
     .release = scull_release, // 当file结构被释放时，调用这个操作
 };
@@ -69,6 +101,158 @@ static void scull_setup_cdev(struct scull_dev* dev , int index){
 
 }
 
+/**
+ * 加锁辅助函数
+ * scull_lock_read/scull_lock_write 锁住整个设备,scull_switch_stripe 再锁住一个量子集
+ * 只有分条模式下写者才和读者一样持有共享锁,由分条锁保证同一量子集上的互斥
+ * RCU 模式下读者只进入 SRCU 读端临界区,*idx 保存 srcu_read_lock 的返回值
+ *
+ * nowait 为真时(IOCB_NOWAIT,例如 io_uring 的内联提交)只尝试加锁,拿不到就返回 -EAGAIN,
+ * 否则可以被致命信号打断,返回 -ERESTARTSYS
+ */
+static int scull_lock_read(struct scull_dev* dev , int* idx , int nowait){
+    if(dev->lock_mode == SCULL_LOCK_RCU){
+        *idx = srcu_read_lock(&dev->srcu);
+        return 0;
+    }
+    if(dev->lock_mode == SCULL_LOCK_EXCL){
+        if(nowait)
+            return down_write_trylock(&dev->rwsem) ? 0 : -EAGAIN;
+        return down_write_killable(&dev->rwsem) ? -ERESTARTSYS : 0;
+    }
+    if(nowait)
+        return down_read_trylock(&dev->rwsem) ? 0 : -EAGAIN;
+    return down_read_killable(&dev->rwsem) ? -ERESTARTSYS : 0;
+}
+
+static void scull_unlock_read(struct scull_dev* dev , int idx){
+    if(dev->lock_mode == SCULL_LOCK_RCU)
+        srcu_read_unlock(&dev->srcu , idx);
+    else if(dev->lock_mode == SCULL_LOCK_EXCL)
+        up_write(&dev->rwsem);
+    else
+        up_read(&dev->rwsem);
+}
+
+static int scull_lock_write(struct scull_dev* dev , int nowait){
+    if(dev->lock_mode == SCULL_LOCK_STRIPE){
+        if(nowait)
+            return down_read_trylock(&dev->rwsem) ? 0 : -EAGAIN;
+        return down_read_killable(&dev->rwsem) ? -ERESTARTSYS : 0;
+    }
+    if(nowait)
+        return down_write_trylock(&dev->rwsem) ? 0 : -EAGAIN;
+    return down_write_killable(&dev->rwsem) ? -ERESTARTSYS : 0;
+}
+
+static void scull_unlock_write(struct scull_dev* dev){
+    if(dev->lock_mode == SCULL_LOCK_STRIPE)
+        up_read(&dev->rwsem);
+    else
+        up_write(&dev->rwsem);
+}
+
+/*
+ * 切换到 item 所在的分条,先释放 old 所在的分条; old/item 为 -1 表示没有
+ * nowait 时拿不到新的分条返回 -EAGAIN,这时 old 已经释放,调用者不再持有任何分条
+ */
+static int scull_switch_stripe(struct scull_dev* dev , int old , int item , int write , int nowait){
+    struct rw_semaphore* sem;
+
+    if(dev->lock_mode != SCULL_LOCK_STRIPE)
+        return 0;
+
+    if(old >= 0){
+        sem = &dev->stripes[old % SCULL_NR_STRIPES];
+        if(write)
+            up_write(sem);
+        else
+            up_read(sem);
+    }
+
+    if(item >= 0){
+        sem = &dev->stripes[item % SCULL_NR_STRIPES];
+        if(nowait && !(write ? down_write_trylock(sem) : down_read_trylock(sem)))
+            return -EAGAIN;
+        if(nowait)
+            return 0;
+        if(write)
+            down_write(sem);
+        else
+            down_read(sem);
+    }
+    return 0;
+}
+
+static void scull_free_work(struct work_struct* work);
+static void scull_reshape_work(struct work_struct* work);
+static struct scull_qset* scull_cursor_get(struct scull_file* sf , int item , gfp_t alloc);
+static inline void scull_reshape_dirty(struct scull_dev* dev , loff_t lo , loff_t hi);
+
+/**
+ * 初始化一个 scull_dev 的锁和目录,scull 设备和 scullpriv 这类动态设备都要调用
+ */
+int scull_dev_init(struct scull_dev* dev){
+    int i;
+
+    dev->qsets = kmalloc(sizeof(struct xarray) , GFP_KERNEL);
+    if(!dev->qsets)
+        return -ENOMEM;
+    dev->node_bytes = kcalloc(nr_node_ids , sizeof(atomic_long_t) , GFP_KERNEL);
+    if(!dev->node_bytes){
+        kfree(dev->qsets);
+        return -ENOMEM;
+    }
+    dev->numa_policy = scull_numa_policy;
+    dev->numa_node = scull_numa_node;
+    dev->numa_next = NUMA_NO_NODE;
+    xa_init(dev->qsets);
+    init_llist_head(&dev->free_list);
+    INIT_WORK(&dev->free_work , scull_free_work);
+    INIT_WORK(&dev->reshape_work , scull_reshape_work);
+    seqcount_init(&dev->geom_seq);
+    init_rwsem(&dev->rwsem);
+    for(i = 0; i < SCULL_NR_STRIPES; i++)
+        init_rwsem(&dev->stripes[i]);
+    mutex_init(&dev->alloc_mutex);
+    init_rwsem(&dev->fault_sem);
+    spin_lock_init(&dev->size_lock);
+    spin_lock_init(&dev->pool_lock);
+    dev->lock_mode = scull_lock_mode;
+    atomic_long_set(&dev->nr_quanta , 0);
+    atomic_long_set(&dev->pending_bytes , 0);
+    atomic_long_set(&dev->pool_hits , 0);
+    atomic_long_set(&dev->pool_misses , 0);
+    if(init_srcu_struct(&dev->srcu)){
+        kfree(dev->node_bytes);
+        kfree(dev->qsets);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * 分配 scull_file 并放进 filp->private_data,scull 和 access.c 里的各种 open 都用它
+ * 对应的释放在 scull_release 中
+ */
+int scull_file_open(struct file* filp , struct scull_dev* dev){
+    struct scull_file* sf = kmalloc(sizeof(struct scull_file) , GFP_KERNEL);
+
+    if(!sf)
+        return -ENOMEM;
+
+    sf->dev = dev;
+    spin_lock_init(&sf->lock);
+    sf->item = -1;
+    sf->dptr = NULL;
+    sf->generation = 0;
+    filp->private_data = sf; // private_data 是一个void * ,方便日后在别的方法下访问
+
+    // read_iter/write_iter 支持 IOCB_NOWAIT,io_uring 可以直接内联提交而不必交给工作线程
+    filp->f_mode |= FMODE_NOWAIT;
+    return 0;
+}
+
 /**
  * 下面的scull_open是个简化版本
  * - 分配并填写置于filp->private_data里的数据结构
@@ -76,18 +260,23 @@ static void scull_setup_cdev(struct scull_dev* dev , int index){
 int scull_open(struct inode *inode , struct file* filp){
 
     struct scull_dev *dev; // 设备信息
+    int retval;
 
     // 这个宏是帮助实现解析inode所包含的参数,然后返回给dev设备信息
     dev = container_of(inode->i_cdev , struct scull_dev , cdev);
-    filp->private_data = dev; // private_data 是一个void * ,方便日后在别的方法下访问
+    retval = scull_file_open(filp , dev);
+    if(retval)
+        return retval;
 
     // 如果设备只写,将设备长度截取为0
     if( (filp->f_flags & O_ACCMODE) == O_WRONLY){
-        if (mutex_lock_interruptible(&dev->mutex))
-			return -ERESTARTSYS;
+        if(down_write_killable(&dev->rwsem)){
+            kfree(filp->private_data);
+            return -ERESTARTSYS;
+        }
         scull_trim(dev);
 
-        mutex_unlock(&dev->mutex);
+        up_write(&dev->rwsem);
     }
 
     return 0;
@@ -97,323 +286,1337 @@ int scull_open(struct inode *inode , struct file* filp){
  * 释放需要关闭的硬件
  */ 
 int scull_release(struct inode* inode , struct file* filp){
+    kfree(filp->private_data);
     return 0;
 }
 
+// 页面模式下量子固定为一页,忽略 scull_quantum
+static inline int scull_default_quantum(void){
+    return scull_backing == SCULL_BACKING_PAGE ? PAGE_SIZE << scull_page_order : scull_quantum;
+}
+
+/*
+ * trim 之后设备采用的几何参数: 用 SCULL_IOCRESHAPE 调整过的设备保持自己的参数,
+ * 只有量子来源变成页面模式时量子大小才被迫改成一页
+ */
+// 页面模式的量子必须是一个复合页
+static inline int scull_page_quantum_ok(int quantum){
+    return quantum >= PAGE_SIZE && is_power_of_2(quantum) && get_order(quantum) <= SCULL_MAX_PAGE_ORDER;
+}
+
+static int scull_trim_quantum(struct scull_dev* dev){
+    if(dev->custom_geometry && (scull_backing != SCULL_BACKING_PAGE || scull_page_quantum_ok(dev->quantum)))
+        return dev->quantum;
+    return scull_default_quantum();
+}
+
+// 2MB 的量子配上默认的 qset 会让量子集的字节数超出 int,这里把 qset 截下来
+static int scull_trim_qset(struct scull_dev* dev){
+    int qset = dev->custom_geometry ? dev->qset : scull_qset;
+
+    return min_t(int , qset , INT_MAX / scull_trim_quantum(dev));
+}
+
+// RCU 模式的读者不持有 rwsem,几何参数和量子来源的修改要放在 geom_seq 的写区间里
+static void scull_set_geometry(struct scull_dev* dev , int quantum , int qset , int layout , int backing){
+    preempt_disable();
+    write_seqcount_begin(&dev->geom_seq);
+    dev->quantum = quantum;
+    dev->qset = qset;
+    dev->layout = layout;
+    dev->backing = backing;
+    write_seqcount_end(&dev->geom_seq);
+    preempt_enable();
+}
+
+/*
+ * 按设备的 NUMA 策略选择新量子的节点,NUMA_NO_NODE 表示由分配器决定(本地节点)
+ * 交错模式下并发的写者可能选到同一个节点,只是稍微不均匀,不需要加锁
+ */
+static int scull_quantum_node(struct scull_dev* dev){
+    int nid;
+
+    switch(READ_ONCE(dev->numa_policy)){
+        case SCULL_NUMA_BIND:
+            return READ_ONCE(dev->numa_node);
+        case SCULL_NUMA_INTERLEAVE:
+            nid = next_node_in(READ_ONCE(dev->numa_next) , node_states[N_MEMORY]);
+            WRITE_ONCE(dev->numa_next , nid);
+            return nid;
+        default:
+            return NUMA_NO_NODE;
+    }
+}
+
+// 量子所在节点的字节统计,slab 和页面模式的量子都在线性映射区里
+static void scull_account_quantum(struct scull_dev* dev , void* q , int sign){
+    atomic_long_add(sign * (long)dev->quantum , &dev->node_bytes[page_to_nid(virt_to_page(q))]);
+}
+
+/**
+ * 量子和量子集指针数组的分配与释放
+ * 优先使用预分配池,其次是本设备的 slab,最后退回 kmalloc
+ * gfp 一般是 GFP_KERNEL;IOCB_NOWAIT 的写入用 GFP_NOWAIT,不能立即满足就失败
+ */
+static void* scull_alloc_quantum(struct scull_dev* dev , gfp_t gfp){
+    int nid = scull_quantum_node(dev);
+    struct page* page;
+    void* q = NULL;
+    int order;
+
+    // 页面模式: 量子就是一个清零的(复合)页,保存它的内核虚拟地址,读写路径不用区分
+    // 高阶分配失败很正常,由 write 返回 -ENOMEM,不必打印警告
+    if(dev->backing == SCULL_BACKING_PAGE){
+        order = get_order(dev->quantum);
+        if(nid == NUMA_NO_NODE)
+            page = alloc_pages(gfp | __GFP_ZERO | (order ? __GFP_COMP | __GFP_NOWARN : 0) , order);
+        else
+            page = alloc_pages_node(nid , gfp | __GFP_ZERO | (order ? __GFP_COMP | __GFP_NOWARN : 0) , order);
+        if(!page)
+            return NULL;
+        atomic_long_inc(&dev->nr_quanta);
+        scull_account_quantum(dev , page_address(page) , 1);
+        return page_address(page);
+    }
+
+    // 池里的量子来自哪个节点都有可能,指定了节点时不使用;池是空的(或者没有启用)就不去拿锁
+    if(nid == NUMA_NO_NODE && READ_ONCE(dev->pool)){
+        spin_lock(&dev->pool_lock);
+        q = dev->pool;
+        if(q){
+            WRITE_ONCE(dev->pool , *(void **)q);
+            dev->pool_count--;
+        }
+        spin_unlock(&dev->pool_lock);
+    }
+
+    if(q){
+        atomic_long_inc(&dev->pool_hits);
+    }else{
+        atomic_long_inc(&dev->pool_misses);
+        if(dev->quantum_cache)
+            q = kmem_cache_alloc_node(dev->quantum_cache , gfp , nid);
+        else
+            q = kmalloc_node(dev->quantum , gfp , nid);
+    }
+    if(q){
+        atomic_long_inc(&dev->nr_quanta);
+        scull_account_quantum(dev , q , 1);
+    }
+    return q;
+}
+
+static void scull_free_quantum(struct scull_dev* dev , void* q){
+    struct page* page;
+
+    if(!q)
+        return;
+    scull_account_quantum(dev , q , -1);
+
+    // 页可能还被 mmap 引用着,__free_pages 只是减少引用计数;阶数取自页本身
+    if(dev->backing == SCULL_BACKING_PAGE){
+        page = virt_to_page(q);
+        __free_pages(page , compound_order(page));
+        return;
+    }
+
+    // 池未满时放回池中,留给下一次写入;没有启用池时不拿锁
+    if(dev->quantum_cache && READ_ONCE(dev->pool_count) < scull_pool_quanta){
+        spin_lock(&dev->pool_lock);
+        if(dev->pool_count < scull_pool_quanta){
+            *(void **)q = dev->pool;
+            WRITE_ONCE(dev->pool , q);
+            dev->pool_count++;
+            q = NULL;
+        }
+        spin_unlock(&dev->pool_lock);
+    }
+    if(dev->quantum_cache){
+        if(q)
+            kmem_cache_free(dev->quantum_cache , q);
+        return;
+    }
+    kfree(q);
+}
+
+static void** scull_alloc_qarray(struct scull_dev* dev , gfp_t gfp){
+    void** data;
+
+    if(dev->qset_cache)
+        data = kmem_cache_alloc(dev->qset_cache , gfp);
+    else
+        data = kmalloc(dev->qset * sizeof(char *) , gfp);
+
+    if(data)
+        memset(data , 0 , dev->qset * sizeof(char *));
+    return data;
+}
+
+static void scull_free_qarray(struct scull_dev* dev , void** data){
+    if(dev->qset_cache)
+        kmem_cache_free(dev->qset_cache , data);
+    else
+        kfree(data);
+}
+
+/*
+ * 取得 dptr 的数组、*slot 处的量子,没有就分配一个装上.
+ * 缺页处理不持有设备锁,可能和写者同时补同一个空位,所以用 cmpxchg 发布,
+ * 后到的释放自己分配的那一份.发布之前内容已经初始化,无锁的读者不会看到半成品
+ */
+static void** scull_get_qarray(struct scull_dev* dev , struct scull_qset* dptr , gfp_t gfp){
+    void** data = smp_load_acquire(&dptr->data);
+    void** old;
+
+    if(data)
+        return data;
+    data = scull_alloc_qarray(dev , gfp);
+    if(!data)
+        return NULL;
+    old = cmpxchg(&dptr->data , NULL , data);
+    if(old){
+        scull_free_qarray(dev , data);
+        return old;
+    }
+    return data;
+}
+
+static void* scull_get_quantum(struct scull_dev* dev , void** slot , gfp_t gfp){
+    void* q = smp_load_acquire(slot);
+    void* old;
+
+    if(q)
+        return q;
+    q = scull_alloc_quantum(dev , gfp);
+    if(!q)
+        return NULL;
+    old = cmpxchg(slot , NULL , q);
+    if(old){
+        atomic_long_dec(&dev->nr_quanta);
+        scull_free_quantum(dev , q);
+        return old;
+    }
+    return q;
+}
+
+/**
+ * 按当前的 quantum/qset 建立 slab,并把预分配池填满
+ * 失败不是致命的: 缓存为 NULL 时所有分配退回 kmalloc
+ */
+static void scull_create_caches(struct scull_dev* dev){
+    void* q;
+
+    dev->qset_cache = kmem_cache_create(dev->qset_cache_name , dev->qset * sizeof(char *) , 0 , 0 , NULL);
+
+    // 页面模式的量子直接来自页分配器,只需要量子集数组的 slab
+    if(dev->backing == SCULL_BACKING_PAGE)
+        return;
+
+    dev->quantum_cache = kmem_cache_create(dev->quantum_cache_name , dev->quantum , 0 , 0 , NULL);
+
+    if(!dev->quantum_cache || !dev->qset_cache){
+        printk(KERN_NOTICE "scull: can't create slab caches, falling back to kmalloc\n");
+        kmem_cache_destroy(dev->quantum_cache);
+        kmem_cache_destroy(dev->qset_cache);
+        dev->quantum_cache = NULL;
+        dev->qset_cache = NULL;
+        return;
+    }
+
+    // 空闲链表的指针存放在量子里,量子太小就不预分配了
+    if(dev->quantum < sizeof(void *))
+        return;
+
+    while(dev->pool_count < scull_pool_quanta){
+        q = kmem_cache_alloc(dev->quantum_cache , GFP_KERNEL);
+        if(!q)
+            break;
+        *(void **)q = dev->pool;
+        dev->pool = q;
+        dev->pool_count++;
+    }
+}
+
+static void scull_destroy_caches(struct scull_dev* dev){
+    void* q;
+
+    while((q = dev->pool) != NULL){
+        dev->pool = *(void **)q;
+        kmem_cache_free(dev->quantum_cache , q);
+    }
+    dev->pool_count = 0;
+
+    kmem_cache_destroy(dev->quantum_cache);
+    kmem_cache_destroy(dev->qset_cache);
+    dev->quantum_cache = NULL;
+    dev->qset_cache = NULL;
+}
+
+// 释放一个量子集,返回释放掉的量子数
+static int scull_free_qset(struct scull_dev* dev , struct scull_qset* dptr){
+    int i , n = 0;
+
+    if(dptr->data){
+        for(i = 0; i < dev->qset; i++){
+            if(dptr->data[i])
+                n++;
+            scull_free_quantum(dev , dptr->data[i]);
+        }
+
+        scull_free_qarray(dev , dptr->data);
+        dptr->data = NULL;
+    }
+    kfree(dptr);
+    return n;
+}
+
 /**
  * scull_trim 负责释放整个数据区,并在文件以写入方式打开时由scull_open调用
  * scull_trim 通过遍历链表，释放所有找到的量子和量子集
  * 模块的清楚函数也使用scull_trim,以便将scull所使用的内存返回给系统
  */
-int scull_trim(struct scull_dev* dev){
-    struct scull_qset* next , *dptr;
-    int qset = dev->qset;
+static void scull_free_chain(struct scull_dev* dev , struct scull_qset* dptr){
+    struct scull_qset* next;
 
-    int i;
-    for(dptr = dev->data; dptr ; dptr = next){
-        
-        if(dptr->data){
-            for(i = 0; i < qset; i++){
-                kfree(dptr->data[i]);
-            }
+    for(; dptr ; dptr = next){
+        next = dptr->next;
+        scull_free_qset(dev , dptr);
+    }
+}
+
+/**
+ * trim 摘下来的整个数据区: 链表布局的表头和索引布局的 xarray
+ * 由 scull_wq 在后台分批释放,RCU 模式下先等一个 SRCU 宽限期
+ */
+struct scull_free_batch {
+    struct rcu_head rcu;
+    struct llist_node node;
+    struct scull_dev* dev;
+    struct scull_qset* head;
+    struct xarray* qsets;
+};
 
-            kfree(dptr->next);
-            dptr->data = NULL;
+#define SCULL_FREE_BATCH 64 // 每释放这么多量子集让出一次 CPU
 
-        }
+static void scull_release_batch(struct scull_free_batch* batch){
+    struct scull_dev* dev = batch->dev;
+    struct scull_qset* dptr , *next;
+    unsigned long index;
+    long n = 0;
+
+    for(dptr = batch->head; dptr ; dptr = next){
         next = dptr->next;
-        kfree(dptr);
+        atomic_long_sub((long)scull_free_qset(dev , dptr) * dev->quantum , &dev->pending_bytes);
+        if(++n % SCULL_FREE_BATCH == 0)
+            cond_resched();
+    }
 
+    xa_for_each(batch->qsets , index , dptr){
+        atomic_long_sub((long)scull_free_qset(dev , dptr) * dev->quantum , &dev->pending_bytes);
+        if(++n % SCULL_FREE_BATCH == 0)
+            cond_resched();
     }
-    dev->size = 0;
-    dev->quantum = scull_quantum;
-    dev->qset = scull_qset;
-    dev->data = NULL;
-    return 0;
+    xa_destroy(batch->qsets);
+    kfree(batch->qsets);
+    kfree(batch);
+}
 
+static void scull_free_work(struct work_struct* work){
+    struct scull_dev* dev = container_of(work , struct scull_dev , free_work);
+    struct scull_free_batch* batch , *tmp;
+    struct llist_node* nodes = llist_del_all(&dev->free_list);
+
+    llist_for_each_entry_safe(batch , tmp , nodes , node){
+        scull_release_batch(batch);
+    }
 }
 
-static int scull_p_fasync(int fd , struct file* filp , int mode){
-    struct scull_pipe* dev = filp->private_data;
-    // 当一个打开的文件的 FASYNC 标志被修改时,调用 fasync_helper 以便从相关的进程列表中增加和删除文件
-    return fasync_helper(fd , filp , mode , &dev->async_queue);
+static void scull_queue_batch(struct scull_free_batch* batch){
+    llist_add(&batch->node , &batch->dev->free_list);
+    queue_work(scull_wq , &batch->dev->free_work);
 }
 
+// SRCU 的回调运行在软中断上下文,真正的释放还是交给工作队列
+static void scull_free_batch_rcu(struct rcu_head* rcu){
+    scull_queue_batch(container_of(rcu , struct scull_free_batch , rcu));
+}
 
-static ssize_t scull_p_read(struct file* filp , char __user *buf , size_t count, loff_t* f_pos){
-    
-    struct scull_pipe* dev = filp->private_data;
+// 等待所有已经提交的延迟释放完成
+static void scull_flush_deferred(struct scull_dev* dev){
+    if(dev->lock_mode == SCULL_LOCK_RCU)
+        srcu_barrier(&dev->srcu);
+    flush_work(&dev->free_work);
+}
 
-    if(dowm(&dev->sem))
-        return -ERESTARTSYS;
-    
-    // P166 - 从设备读取数据
-    // 查看第二条:缓冲区没有数据所要执行的操作
-    while(dev->rp == dev->wp){
-        up(&dev->sem);
-        if(filp->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-        PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-        // 默认情况下应该阻塞等待
-        if(wait_event_interruptible(dev->inq , (dev->rp != dev->wp)))
-            return -ERESTARTSYS;
-        if(dowm(&dev->sem))
-            return -ERESTARTSYS;
+/*
+ * 让所有打开文件的游标失效.必须在新目录发布之后调用: RCU 模式的读者不持有 rwsem,
+ * 如果先看到新 generation 再查到旧目录,会把 {旧量子集, 新 generation} 存进游标,
+ * 旧量子集释放之后游标仍然"有效"
+ */
+static inline void scull_bump_generation(struct scull_dev* dev){
+    smp_store_release(&dev->generation , dev->generation + 1);
+}
+
+/**
+ * scull_trim 负责释放整个数据区,并在文件以写入方式打开时由scull_open调用
+ * 模块的清楚函数也使用scull_trim,以便将scull所使用的内存返回给系统
+ *
+ * 调用者只需要把链表表头和 xarray 整个换下来,代价是 O(1);
+ * 真正遍历释放量子和量子集的工作交给 scull_wq,进度体现在 pending_bytes 上.
+ * RCU 模式下还可能有读者在访问旧数据,所以要先等一个 SRCU 宽限期.
+ *
+ * 几何参数变化时旧数据必须按旧参数、用旧的 slab 释放,而且读者可能拿着旧参数访问新目录,
+ * 这时只能等之前的释放全部完成后同步释放.内存不足时也退回同步释放
+ */
+int scull_trim(struct scull_dev* dev){
+    struct scull_free_batch* batch = NULL;
+    struct scull_qset* head , *dptr;
+    struct xarray* qsets = NULL;
+    unsigned long index;
+    int changed , rebuild;
+    int quantum , qset;
+
+    // 缺页处理不持有 rwsem,换下目录和几何参数期间把它挡在外面
+    down_write(&dev->fault_sem);
+    WRITE_ONCE(dev->size , 0);
+
+    changed = dev->quantum != scull_trim_quantum(dev) || dev->qset != scull_trim_qset(dev) ||
+              dev->backing != scull_backing || dev->layout != scull_layout;
+
+    if(!changed && scull_wq){
+        batch = kmalloc(sizeof(*batch) , GFP_KERNEL);
+        qsets = kmalloc(sizeof(struct xarray) , GFP_KERNEL);
     }
 
-    if(dev->wp > dev->rp)
-        count = min(count , (size_t)(dev->wp - dev->rp));
-    else    
-        count = min(count , (size_t)(dev->end - dev->rp));
-    
-    if(copy_to_user(buf , dev->rp , count)){
-        up(&dev->sem);
-        return -EFAULT;
+    if(batch && qsets){
+        xa_init(qsets);
+        batch->dev = dev;
+        batch->head = dev->data;
+        batch->qsets = dev->qsets;
+
+        // 两种布局都可能有数据(布局只在trim时切换),整个换下来
+        WRITE_ONCE(dev->data , NULL);
+        smp_store_release(&dev->qsets , qsets);
+        scull_bump_generation(dev);
+        atomic_long_add(atomic_long_xchg(&dev->nr_quanta , 0) * dev->quantum , &dev->pending_bytes);
+
+        if(dev->lock_mode == SCULL_LOCK_RCU)
+            call_srcu(&dev->srcu , &batch->rcu , scull_free_batch_rcu);
+        else
+            scull_queue_batch(batch);
+        up_write(&dev->fault_sem);
+        return 0;
+    }
+    kfree(batch);
+    kfree(qsets);
+
+    // 同步释放: 先把两种布局的量子集摘下来串成一条链
+    head = dev->data;
+    WRITE_ONCE(dev->data , NULL);
+
+    // 索引布局的读者不会访问 next,可以借用它把量子集串起来
+    xa_for_each(dev->qsets , index , dptr){
+        xa_erase(dev->qsets , index);
+        dptr->next = head;
+        head = dptr;
     }
+    scull_bump_generation(dev);
+
+    if(dev->lock_mode == SCULL_LOCK_RCU)
+        synchronize_srcu(&dev->srcu);
+    scull_flush_deferred(dev);
+    scull_free_chain(dev , head);
+    atomic_long_set(&dev->nr_quanta , 0);
+
+    // 量子大小或来源变了,slab 和池里的量子都不能再用,按新的参数重建
+    rebuild = changed && (dev->quantum_cache || dev->qset_cache);
+    if(rebuild)
+        scull_destroy_caches(dev);
+
+    quantum = scull_trim_quantum(dev);
+    qset = scull_trim_qset(dev);
+    scull_set_geometry(dev , quantum , qset , scull_layout , scull_backing);
+
+    if(rebuild)
+        scull_create_caches(dev);
+    up_write(&dev->fault_sem);
+    return 0;
+
+}
 
-    dev->rp += count;
-    if(dev->rp == dev->end){
-        dev->rp = dev->buffer;
+/**
+ * 释放 scull_dev_init 建立的资源,调用前设备必须已经 trim 过
+ */
+void scull_dev_destroy(struct scull_dev* dev){
+    scull_flush_deferred(dev);
+    scull_destroy_caches(dev);
+    xa_destroy(dev->qsets);
+    kfree(dev->qsets);
+    kfree(dev->node_bytes);
+    cleanup_srcu_struct(&dev->srcu);
+}
+
+/*
+ * /proc/scullmem: 每个设备的几何参数以及预分配池的命中情况
+ */
+static int scull_mem_proc_show(struct seq_file* m , void* v){
+    int i , nid;
+
+    for(i = 0; i < scull_nr_devs; i++){
+        struct scull_dev* d = &scull_devices[i];
+
+        if(down_read_killable(&d->rwsem))
+            return -ERESTARTSYS;
+        seq_printf(m , "\nDevice %i: qset %i, q %i, sz %li, %s, %s, lock %i\n",
+                i , d->qset , d->quantum , d->size,
+                d->layout == SCULL_LAYOUT_INDEX ? "index" : "list",
+                d->backing == SCULL_BACKING_PAGE ? "page" : "slab",
+                d->lock_mode);
+        seq_printf(m , "  slab %s, pool %i/%i, hits %li, misses %li\n",
+                d->quantum_cache ? "yes" : "no" , d->pool_count , scull_pool_quanta,
+                atomic_long_read(&d->pool_hits) , atomic_long_read(&d->pool_misses));
+        seq_printf(m , "  quanta %li, pending free %li bytes, reshape %i\n",
+                atomic_long_read(&d->nr_quanta) , atomic_long_read(&d->pending_bytes),
+                READ_ONCE(d->reshape_status));
+        seq_printf(m , "  numa %s," ,
+                d->numa_policy == SCULL_NUMA_BIND ? "bind" :
+                d->numa_policy == SCULL_NUMA_INTERLEAVE ? "interleave" : "local");
+        for_each_node_state(nid , N_MEMORY)
+            seq_printf(m , " node%d %li" , nid , atomic_long_read(&d->node_bytes[nid]));
+        seq_putc(m , '\n');
+        up_read(&d->rwsem);
     }
+    return 0;
+}
+
+static int scull_mem_proc_open(struct inode* inode , struct file* file){
+    return single_open(file , scull_mem_proc_show , NULL);
+}
+
+// 5.6 起 /proc 文件用 proc_ops 而不是 file_operations
+static const struct proc_ops scull_mem_proc_fops = {
+    .proc_open    = scull_mem_proc_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = single_release,
+};
 
-    up(&dev->sem);
 
-    // 最后唤醒任何正在等待的写进程
-	wake_up_interruptible(&dev->outq);
-	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
-	return count;
 
+/*
+ * 量子集编号是 int,而且用 (long)pos 做除法: 能表示的位置必须两者都放得下.
+ * 超过它的写入返回 -EFBIG,否则编号截断后会悄悄写到前面的数据上
+ */
+static inline loff_t scull_max_pos(int itemsize){
+    return min_t(loff_t , (loff_t)INT_MAX * itemsize , LONG_MAX);
 }
-/**
- * read():dev->user,从设备拷贝数据到用户空间(需要使用 copy_to_user)
- */ 
-ssize_t scull_read(struct file* filp , char __user *buf , size_t count, loff_t* f_pos){
 
-    struct scull_dev* dev = filp->private_data;
-    struct scull_qset *dptr; // 第一个链表项
-    int quantum = dev->quantum, qset = dev->qset; // 量子数 和 量子集数量
-    int itemsize = quantum * qset; // 该链表项有多少个字节
+/**
+ * read():dev->user,从设备拷贝数据到用户空间
+ * 一次调用会跨越量子和量子集的边界,在一个临界区内把用户的缓冲区(或 readv 的多个缓冲区)填满,
+ * 而不是每个量子一次系统调用
+ */
+ssize_t scull_read_iter(struct kiocb* iocb , struct iov_iter* to){
+
+    struct scull_file* sf = iocb->ki_filp->private_data;
+    struct scull_dev* dev = sf->dev;
+    struct scull_qset *dptr = NULL;
+    int nowait = iocb->ki_flags & IOCB_NOWAIT;
+    int quantum , qset; // 量子数 和 量子集数量
+    int itemsize; // 该链表项有多少个字节
     int item , s_pos , q_pos , rest;
+    int cur_item = -1; // dptr 对应的量子集编号
+    loff_t pos = iocb->ki_pos;
+    size_t count , chunk , copied;
+
+    unsigned long size;
+    unsigned int seq;
+    void** data;
+    void* q;
+    int idx = 0;
 
     ssize_t retval = 0;
 
-    if(down_interruptible(&dev->sem)){
-        return -ERESTARTSYS;
-    }
+    retval = scull_lock_read(dev , &idx , nowait);
+    if(retval)
+        return retval;
+
+    // 几何参数要在加锁之后读取;RCU 模式下还要配合 geom_seq 检查它是否被 reshape 换掉
+    seq = read_seqcount_begin(&dev->geom_seq);
+    quantum = dev->quantum;
+    qset = dev->qset;
+    itemsize = quantum * qset;
 
-    if(*f_pos >= dev->size)
+    size = READ_ONCE(dev->size);
+    if(pos >= size)
         goto out;
     // 不足count的大小了
-    if(*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
-    
-    // 在量子集中寻找链表项，qset索引以及偏移量
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+    count = min_t(size_t , iov_iter_count(to) , size - pos);
 
-    // 沿链表前行，直到找到正确的位置
-    dptr = scull_follow(dev , item);
+    while(count){
+        // reshape 把量子集改小之后,旧的 size 可能超出能表示的范围
+        if(pos >= scull_max_pos(itemsize))
+            break;
+        // 在量子集中寻找链表项，qset索引以及偏移量
+        item = (long)pos / itemsize;
+        rest = (long)pos % itemsize;
+        s_pos = rest / quantum;
+        q_pos = rest % quantum;
+
+        // 只有跨过量子集边界时才需要重新定位,读者不分配任何东西
+        if(item != cur_item){
+            if(scull_switch_stripe(dev , cur_item , item , 0 , nowait)){
+                // 已经读到的部分照常返回
+                cur_item = -1;
+                if(retval == 0)
+                    retval = -EAGAIN;
+                break;
+            }
+            dptr = scull_cursor_get(sf , item , 0);
+            cur_item = item;
+
+            // 目录已经按新的几何参数换过了,dptr 不能用旧参数访问: 按新参数从 pos 重新定位
+            if(read_seqcount_retry(&dev->geom_seq , seq)){
+                seq = read_seqcount_begin(&dev->geom_seq);
+                quantum = dev->quantum;
+                qset = dev->qset;
+                itemsize = quantum * qset;
+                scull_switch_stripe(dev , cur_item , -1 , 0 , 0);
+                cur_item = -1;
+                continue;
+            }
+        }
 
-    if(dptr == NULL || !dptr->data || !dptr->data[s_pos])
-        goto out;
+        // RCU 模式下写者可能同时在发布新的指针,用 acquire 读取
+        data = dptr ? smp_load_acquire(&dptr->data) : NULL;
+        q = data ? smp_load_acquire(&data[s_pos]) : NULL;
+
+        if(!data){
+            // 整个量子集都是空洞,一次把它读成 0
+            chunk = min_t(size_t , count , itemsize - rest);
+            copied = iov_iter_zero(chunk , to);
+        }else if(!q){
+            // 单个量子是空洞
+            chunk = min_t(size_t , count , quantum - q_pos);
+            copied = iov_iter_zero(chunk , to);
+        }else{
+            // 每次最多读到当前量子的末尾,然后继续下一个量子
+            chunk = min_t(size_t , count , quantum - q_pos);
+            copied = copy_to_iter(q + q_pos , chunk , to);
+        }
 
-    // 读取该量子的数据直到末尾
-    if(count > quantum - q_pos)
-        count = quantum - q_pos;
-    
-    if(copy_to_user(buf , dptr->data[s_pos] + q_pos , count)){
-        retval = -EFAULT;
-        goto out;
+        pos += copied;
+        retval += copied;
+        count -= copied;
+
+        if(copied < chunk){
+            if(retval == 0)
+                retval = -EFAULT;
+            break;
+        }
     }
 
-    *f_pos += count;
-    retval = count;
+    scull_switch_stripe(dev , cur_item , -1 , 0 , 0);
+    iocb->ki_pos = pos;
 
 out:
-    up(&dev->sem);
+    scull_unlock_read(dev , idx);
     return retval;
 
 }
 
-ssize_t scull_p_write(struct file* filp ,const char __user* buf, size_t count , loff_t* f_pos){
-    struct scull_pipe* dev = filp->private_data;
 
-    int result;
+/**
+ * write():user->dev,从用户空间写入设备中
+ * 和 scull_read_iter 一样,在一个临界区内跨越量子边界把整个用户缓冲区写完
+ */
+ssize_t scull_write_iter(struct kiocb* iocb , struct iov_iter* from){
+
+    struct scull_file* sf = iocb->ki_filp->private_data;
+    struct scull_dev *dev = sf->dev;
+    struct scull_qset *dptr = NULL;
+    int nowait = iocb->ki_flags & IOCB_NOWAIT;
+    gfp_t gfp = nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL;
+    int quantum , qset;
+    int itemsize;
+    int item, s_pos ,q_pos , rest;
+    int cur_item = -1;
+    loff_t pos = iocb->ki_pos;
+    size_t chunk , copied;
+    void** data;
+    void* q;
 
-    if(down(&dev->sem))
-        return -ERESTARTSYS;
- 
-    result = scull_getwritespace(dev , filp);
-    if(result == 0)
-        return result;
-
-    count = min( (size_t)spacefree(dev) , count);
-    if(dev->wp >= dev_rp)
-        count = min(count , (size_t)(dev->end - dev_wp));
-    else   
-        count = min(count , (size_t)(dev-rp - dev->wp - 1));
+    ssize_t retval = 0;
     
-    PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
+    // 需要对返回值进行检查,如果返回非零值,则说明操作被中断(或 IOCB_NOWAIT 时锁被占用)
+    retval = scull_lock_write(dev , nowait);
+    if(retval)
+        return retval;
+
+    // 持有写锁时几何参数不会改变(reshape 和 trim 都独占 rwsem)
+    quantum = dev->quantum;
+    qset = dev->qset;
+    itemsize = quantum * qset;
+
+    while(iov_iter_count(from)){
+        if(pos >= scull_max_pos(itemsize)){
+            if(retval == 0)
+                retval = -EFBIG;
+            break;
+        }
+        item = (long)pos / itemsize;
+        rest = (long)pos % itemsize;
+        s_pos = rest / quantum;
+        q_pos = rest % quantum;
+
+        if(item != cur_item){
+            if(scull_switch_stripe(dev , cur_item , item , 1 , nowait)){
+                cur_item = -1;
+                goto nomem;
+            }
+            cur_item = item;
+            dptr = scull_cursor_get(sf , item , gfp);
+            if(dptr == NULL)
+                goto nomem;
+        }
 
-    if(copy_from_user(dev->wp , buf, count)){
-        up(&dev->sem);
-        return -EFAULT;
+        // 缺少的数组和量子现在补上,缺页处理可能同时在补同一个
+        data = scull_get_qarray(dev , dptr , gfp);
+        if(!data)
+            goto nomem;
+        q = scull_get_quantum(dev , &data[s_pos] , gfp);
+        if(!q)
+            goto nomem;
+
+        chunk = min_t(size_t , iov_iter_count(from) , quantum - q_pos);
+        copied = copy_from_iter(q + q_pos , chunk , from);
+
+        pos += copied;
+        retval += copied;
+
+        if(copied < chunk){
+            if(retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+    }
+    goto out;
+
+nomem:
+    // 已经写入了一部分就返回写入的字节数;IOCB_NOWAIT 时让调用者换成可以阻塞的方式重试
+    if(retval == 0)
+        retval = nowait ? -EAGAIN : -ENOMEM;
+
+out:
+    scull_switch_stripe(dev , cur_item , -1 , 1 , 0);
+    iocb->ki_pos = pos;
+
+    // 分条模式下可能有多个写者同时扩展设备
+    spin_lock(&dev->size_lock);
+    if(dev->size < pos)
+        WRITE_ONCE(dev->size , pos);
+    if(retval > 0)
+        scull_reshape_dirty(dev , pos - retval , pos);
+    spin_unlock(&dev->size_lock);
+
+    // 不论scull_wirte能否完成其他任务,都必须释放锁
+    // scull_write可能发生的错误:内存分配失败,视图从用户空间复制数据时产生故障
+    scull_unlock_write(dev);
+    return retval;   
+
+}
+
+
+static struct scull_qset* scull_new_qset(gfp_t gfp){
+    struct scull_qset* qs = kmalloc(sizeof(struct scull_qset) , gfp);
+
+    if(qs)
+        memset(qs , 0 , sizeof(struct scull_qset));
+    return qs;
+}
+
+/**
+ * 索引布局: 直接按量子集编号在 xarray 中查找,不存在时再分配
+ * 无论 n 多大,代价都是 O(log n),不需要分配中间的量子集
+ */
+static struct scull_qset* scull_follow_index(struct scull_dev* dev , int n , gfp_t gfp){
+    struct scull_qset* qs = xa_load(dev->qsets , n);
+    struct scull_qset* old;
+
+    if(qs)
+        return qs;
+
+    qs = scull_new_qset(gfp);
+    if(qs == NULL)
+        return NULL;
+
+    // 分条模式下其他量子集的写者可能同时插入,只有第一个插入的生效
+    old = xa_cmpxchg(dev->qsets , n , NULL , qs , gfp);
+    if(old){
+        kfree(qs);
+        return xa_is_err(old) ? NULL : old;
     }
 
-    dev->wp += count; 
-    if(dev->wp == dev->end){
-        dev->wp = dev->buffer;
+    return qs;
+}
+
+/**
+ * 链表布局下追加 *link 指向的节点
+ * 分条模式下多个写者可能同时走到表尾,用 alloc_mutex 串行化,
+ * 节点初始化完成后再用 release 语义发布,无锁遍历的读者总能看到完整的节点
+ * 不允许睡眠的分配(GFP_NOWAIT)也不能等 alloc_mutex
+ */
+static struct scull_qset* scull_append_qset(struct scull_dev* dev , struct scull_qset** link , gfp_t gfp){
+    struct scull_qset* qs;
+
+    if(gfpflags_allow_blocking(gfp))
+        mutex_lock(&dev->alloc_mutex);
+    else if(!mutex_trylock(&dev->alloc_mutex))
+        return NULL;
+    qs = *link;
+    if(!qs){
+        qs = scull_new_qset(gfp);
+        if(qs)
+            smp_store_release(link , qs);
     }
-    up(&dev->sem);
+    mutex_unlock(&dev->alloc_mutex);
+    return qs;
+}
 
+// 链表布局: 从 qs 开始向后走 n 步,缺少的节点随手补上
+static struct scull_qset* scull_follow_from(struct scull_dev* dev , struct scull_qset* qs , int n , gfp_t gfp){
+    struct scull_qset* next;
+
+    // Then follow the list
+    while(n--){
+        next = smp_load_acquire(&qs->next);
+        if(!next){
+            next = scull_append_qset(dev , &qs->next , gfp);
+            if(next == NULL)
+                return NULL;
+        }
 
-    // 唤醒任何等待的读进程
-	wake_up_interruptible(&dev->inq);
-    if(dev->async_queue){
-        // 数据到达后,通知相关进程
-        kill_fasync(&dev->async_queue , SIGIO , POLL_IN);
+        qs = next;
     }
-	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
-	return count;
 
+    return qs;
+}
+
+struct scull_qset *scull_follow(struct scull_dev *dev, int n , gfp_t gfp){
+
+    struct scull_qset* qs;
+
+    if(dev->layout == SCULL_LAYOUT_INDEX)
+        return scull_follow_index(dev , n , gfp);
 
+    // 链表布局: 从表头开始沿链表前行
+    qs = smp_load_acquire(&dev->data);
+    if(!qs){
+        qs = scull_append_qset(dev , &dev->data , gfp);
+        if(qs == NULL)
+            return NULL;
+    }
+
+    return scull_follow_from(dev , qs , n , gfp);
 }
 
 /**
- * write():user->dev,从用户空间写入设备中(需要使用 copy_from_user)
- * 每次只处理一个量子
- */ 
-ssize_t scull_write(struct file* filp ,const char __user* buf, size_t count , loff_t* f_pos){
+ * 和 scull_follow 一样定位第 n 个量子集,但不存在时返回 NULL 而不分配
+ * 读者只持有共享锁,不能修改目录
+ */
+struct scull_qset *scull_lookup(struct scull_dev *dev, int n){
+    struct scull_qset* qs;
 
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;
-    int quantum = dev->quantum , qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos ,q_pos , rest;
+    if(dev->layout == SCULL_LAYOUT_INDEX)
+        return xa_load(smp_load_acquire(&dev->qsets) , n);
 
-    ssize_t retval = -ENOMEM;
-    
-    // 需要对返回值进行检查,如果返回非零值,则说明操作被中断
-    if(down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
+    qs = smp_load_acquire(&dev->data);
+    while(qs && n--)
+        qs = smp_load_acquire(&qs->next);
 
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
+    return qs;
+}
 
-    dptr = scull_follow(dev, item);
-    
-    if(dptr == NULL)
-        goto out;
+/**
+ * 通过打开文件的游标定位第 item 个量子集,alloc 不为 0 时按 scull_follow 的方式用这个 gfp 补齐
+ * 游标只在设备 generation 未变时有效: trim 会释放游标指向的量子集.
+ * 链表布局下只要目标不在游标之前,就从游标处继续走,顺序读写因此是 O(1) 的
+ */
+static struct scull_qset* scull_cursor_get(struct scull_file* sf , int item , gfp_t alloc){
+    struct scull_dev* dev = sf->dev;
+    // 和 scull_bump_generation 配对: 看到新 generation 的人一定也看到新目录
+    unsigned long gen = smp_load_acquire(&dev->generation);
+    struct scull_qset* dptr = NULL;
+    int cur_item = -1;
+
+    spin_lock(&sf->lock);
+    if(sf->generation == gen && sf->dptr){
+        dptr = sf->dptr;
+        cur_item = sf->item;
+    }
+    spin_unlock(&sf->lock);
 
-    if(!dptr->data){
-        dptr->data = kmalloc(qset * sizeof(char *) ,  GFP_KERNEL);
+    if(dptr && cur_item == item)
+        return dptr;
 
-        if(!dptr->data)
-            goto out;
-        
-        memset(dptr->data,  0,qset * sizeof(char*));
+    if(dptr && dev->layout == SCULL_LAYOUT_LIST && cur_item < item){
+        if(alloc){
+            dptr = scull_follow_from(dev , dptr , item - cur_item , alloc);
+        }else{
+            while(dptr && cur_item++ < item)
+                dptr = smp_load_acquire(&dptr->next);
+        }
+    }else{
+        dptr = alloc ? scull_follow(dev , item , alloc) : scull_lookup(dev , item);
     }
 
-    if(!dptr->data[s_pos]){
-        dptr->data[s_pos] = kmalloc(quantum , GFP_KERNEL);
-        if(!dptr->data[s_pos])
-            goto out;
+    if(dptr){
+        spin_lock(&sf->lock);
+        sf->item = item;
+        sf->dptr = dptr;
+        sf->generation = gen;
+        spin_unlock(&sf->lock);
     }
+    return dptr;
+}
 
-    if(count > quantum - q_pos)
-        count = quantum - q_pos;
+/*
+ * 在线调整几何参数(SCULL_IOCRESHAPE)
+ *
+ * 在 scull_wq 上执行: 先建一个临时设备,把现有数据按新的 quantum/qset 排布进去,
+ * 再在 geom_seq 的写区间里把两边的目录和几何参数整个交换,最后把换下来的旧数据释放掉.
+ * 排布分步进行,每次只在写锁下处理一个量子集,读写者在两步之间通过;
+ * 期间写过的范围记在 reshape_lo/reshape_hi 里,之后重新拷贝,
+ * 只有最后剩下的一小段和交换在同一次写锁里完成.
+ * RCU 模式的读者通过 geom_seq 发现交换并重新定位.
+ *
+ * 量子大小不变时(包括页面模式)量子原样搬到新目录,mmap 出去的页仍然有效;
+ * 否则逐个量子拷贝,原来的空洞在新布局中仍然是空洞;这时经由 mmap 直接写进旧量子的数据
+ * 不经过 write(),没有记录,拷贝之后的修改会丢失.
+ */
 
-    if(copy_from_user( dptr->data[s_pos] + q_pos , buf, count)){
-        retval = -EFAULT;
-        goto out;
-    }
+// 新旧 slab 会同时存在一段时间,名字末尾加上或去掉一个 '~' 以示区别
+static void scull_alt_name(char* dst , const char* src , size_t len){
+    size_t n = strlen(src);
 
-    *f_pos += count;
-    retval = count;
+    if(n && src[n - 1] == '~')
+        snprintf(dst , len , "%.*s" , (int)(n - 1) , src);
+    else
+        snprintf(dst , len , "%s~" , src);
+}
 
-    if(dev->size < *f_pos)
-        dev->size = *f_pos;
+// 同步释放整个目录,调用者保证已经没有人在访问它
+static void scull_free_dir(struct scull_dev* dev){
+    struct scull_qset* dptr;
+    unsigned long index;
 
-out:
-    // 不论scull_wirte能否完成其他任务,都必须释放信号量
-    // scull_write可能发生的错误:内存分配失败,视图从用户空间复制数据时产生故障
-    up(&dev->sem);
-    return retval;   
+    scull_free_chain(dev , dev->data);
+    dev->data = NULL;
 
+    xa_for_each(dev->qsets , index , dptr){
+        xa_erase(dev->qsets , index);
+        scull_free_qset(dev , dptr);
+    }
 }
 
-static unsigned int scull_p_poll(struct file* filp , poll_table* wait){
+// 定位 tmp 中第 item 个量子集并确保它的数组存在;链表布局下用 *cur 避免每次从表头走
+static void** scull_reshape_slot(struct scull_dev* tmp , int item , struct scull_qset** cur , int* cur_item){
+    struct scull_qset* dptr;
+
+    if(*cur && tmp->layout == SCULL_LAYOUT_LIST && *cur_item <= item)
+        dptr = scull_follow_from(tmp , *cur , item - *cur_item , GFP_KERNEL);
+    else
+        dptr = scull_follow(tmp , item , GFP_KERNEL);
+    if(!dptr)
+        return NULL;
+    *cur = dptr;
+    *cur_item = item;
+
+    if(!dptr->data)
+        dptr->data = scull_alloc_qarray(tmp , GFP_KERNEL);
+    return dptr->data;
+}
 
-    struct scull_pipe* dev = filp->private_data;
-    unsigned int mask = 0;
+/*
+ * 把 dev 中第 k 个量子(内容为 q)放进 tmp
+ * move 为假且量子大小相同时只建立目录,move 为真时才真正放入量子指针
+ */
+static int scull_reshape_quantum(struct scull_dev* dev , struct scull_dev* tmp , long k , void* q ,
+                                 int move , struct scull_qset** cur , int* cur_item){
+    loff_t pos = (loff_t)k * dev->quantum;
+    loff_t end = min_t(loff_t , pos + dev->quantum , dev->size);
+    long itemsize = (long)tmp->quantum * tmp->qset;
+    int rest , s_pos , q_pos;
+    size_t chunk;
+    void** data;
+
+    // 新的几何参数下量子集编号放不下
+    if(end > scull_max_pos(itemsize))
+        return -EFBIG;
+
+    if(tmp->quantum == dev->quantum){
+        data = scull_reshape_slot(tmp , k / tmp->qset , cur , cur_item);
+        if(!data)
+            return -ENOMEM;
+        if(move)
+            data[k % tmp->qset] = q;
+        return 0;
+    }
 
-    // 缓冲区是环形的,如果wp在rp之后,则表明缓冲区已满,而如果它们两个相等,则表明是空的    
-    down(&dev->sem);
-    poll_wait(filp , &dev->inq , wait);
-    poll_wait(filp , &dev->outq , wait);
+    // 超过 size 的部分读不到,不必拷贝
+    while(pos < end){
+        rest = (long)pos % itemsize;
+        s_pos = rest / tmp->quantum;
+        q_pos = rest % tmp->quantum;
+
+        data = scull_reshape_slot(tmp , (long)pos / itemsize , cur , cur_item);
+        if(!data)
+            return -ENOMEM;
+        if(!data[s_pos]){
+            data[s_pos] = scull_alloc_quantum(tmp , GFP_KERNEL);
+            if(!data[s_pos])
+                return -ENOMEM;
+            // 新量子里没有被旧量子覆盖的部分原来是空洞,必须读出 0
+            memset(data[s_pos] , 0 , tmp->quantum);
+        }
 
-    if(dev->rp != dev->wp){
-        // 可读取
-        mask |= POLLIN | POLLRDNORM;
+        chunk = min_t(loff_t , end - pos , tmp->quantum - q_pos);
+        memcpy(data[s_pos] + q_pos , q + (pos - (loff_t)k * dev->quantum) , chunk);
+        pos += chunk;
     }
+    return 0;
+}
+
+// 遍历 dev 的第一个量子集;*index 返回它的编号.调用者持有写锁
+static struct scull_qset* scull_reshape_first(struct scull_dev* dev , unsigned long* index){
+    *index = 0;
+    if(dev->layout == SCULL_LAYOUT_LIST)
+        return dev->data;
+    return xa_find(dev->qsets , index , ULONG_MAX , XA_PRESENT);
+}
 
-    if(spacefree(dev)){
-        // 可写入
-        mask |= POLLOUT | POLLWRMORM;
+/*
+ * 把 dev 的第 index 个量子集(dptr)里所有存在的量子放进 tmp,返回下一个量子集.
+ * 链表布局下节点只在 trim 时摘下,generation 没变时 dptr 在两次加锁之间一直有效
+ */
+static struct scull_qset* scull_reshape_step(struct scull_dev* dev , struct scull_dev* tmp , struct scull_qset* dptr ,
+                                             unsigned long* index , int move , struct scull_qset** cur , int* cur_item , int* ret){
+    int i;
+
+    *ret = 0;
+    for(i = 0; dptr->data && i < dev->qset; i++){
+        if(!dptr->data[i])
+            continue;
+        *ret = scull_reshape_quantum(dev , tmp , (long)*index * dev->qset + i , dptr->data[i] ,
+                                     move , cur , cur_item);
+        if(*ret)
+            return NULL;
     }
 
-    up(&dev->sem);
-    return mask
+    if(dev->layout == SCULL_LAYOUT_LIST){
+        (*index)++;
+        return dptr->next;
+    }
+    return xa_find_after(dev->qsets , index , ULONG_MAX , XA_PRESENT);
+}
+
+// 按编号顺序一次遍历 dev 中所有存在的量子,调用者一直持有写锁
+static int scull_reshape_fill(struct scull_dev* dev , struct scull_dev* tmp , int move){
+    struct scull_qset* dptr , *cur = NULL;
+    unsigned long index;
+    int cur_item = -1 , ret = 0;
+
+    for(dptr = scull_reshape_first(dev , &index); dptr ; cond_resched())
+        dptr = scull_reshape_step(dev , tmp , dptr , &index , move , &cur , &cur_item , &ret);
+    return ret;
+}
+
+/*
+ * 量子大小不同时重新拷贝 [lo, hi) 覆盖到的量子,调用者持有写锁.
+ * 写入只会让旧量子出现或者变化,不会消失(那要经过 trim,generation 会变)
+ */
+static int scull_reshape_range(struct scull_dev* dev , struct scull_dev* tmp , loff_t lo , loff_t hi ,
+                               struct scull_qset** cur , int* cur_item){
+    struct scull_qset* dptr;
+    long k , last;
+    int ret;
+
+    if(lo >= hi)
+        return 0;
+    last = (hi - 1) / dev->quantum;
+    for(k = lo / dev->quantum; k <= last; k++){
+        dptr = scull_lookup(dev , k / dev->qset);
+        if(!dptr || !dptr->data || !dptr->data[k % dev->qset])
+            continue;
+        ret = scull_reshape_quantum(dev , tmp , k , dptr->data[k % dev->qset] , 0 , cur , cur_item);
+        if(ret)
+            return ret;
+    }
+    return 0;
+}
 
+/*
+ * 写者调用: 调整进行中时记下写过的范围,交换之前重新拷贝这一段.
+ * 调用者持有写锁,分条模式下还要持有 size_lock
+ */
+static inline void scull_reshape_dirty(struct scull_dev* dev , loff_t lo , loff_t hi){
+    if(!test_bit(0 , &dev->reshaping) || lo >= hi)
+        return;
+    if(lo < dev->reshape_lo)
+        dev->reshape_lo = lo;
+    if(hi > dev->reshape_hi)
+        dev->reshape_hi = hi;
 }
 
-struct scull_qset *scull_follow(struct scull_dev *dev, int n){
+// 取走记下的范围并清空,调用者持有写锁(排除了所有写者)
+static void scull_reshape_take_dirty(struct scull_dev* dev , loff_t* lo , loff_t* hi){
+    *lo = dev->reshape_lo;
+    *hi = dev->reshape_hi;
+    dev->reshape_lo = LLONG_MAX;
+    dev->reshape_hi = 0;
+}
 
-    struct scull_qset* qs = dev->data;
+// 调整完成后 tmp 持有旧的目录;量子被搬走时先把指针清掉,免得被释放两次
+static void scull_forget_quanta(struct scull_dev* dev){
+    struct scull_qset* dptr;
+    unsigned long index;
+
+    for(dptr = dev->data; dptr ; dptr = dptr->next)
+        if(dptr->data)
+            memset(dptr->data , 0 , dev->qset * sizeof(char *));
+    xa_for_each(dev->qsets , index , dptr)
+        if(dptr->data)
+            memset(dptr->data , 0 , dev->qset * sizeof(char *));
+}
 
-    if(!qs){
-        qs = dev->data = kmalloc(sizeof(struct scull_qset) , GFP_KERNEL);
-        if(qs == NULL)
-            return NULL;
-        
-        memset(qs, 0 ,sizeof(struct scull_qset));
+// 补拷的范围小于这么多个旧量子集时,直接在最后的写锁里补完
+#define SCULL_RESHAPE_TAIL   4
+// 补拷的轮数上限,写得比拷得快时不再追,在最后的写锁里补完
+#define SCULL_RESHAPE_ROUNDS 8
+
+static void scull_reshape_work(struct work_struct* work){
+    struct scull_dev* dev = container_of(work , struct scull_dev , reshape_work);
+    struct scull_qset* dptr , *cur = NULL;
+    struct scull_dev* tmp;
+    unsigned long index , gen;
+    int move , ret , round , cur_item = -1;
+    loff_t lo , hi , step , tail;
+
+restart:
+    tmp = kzalloc(sizeof(*tmp) , GFP_KERNEL);
+    if(!tmp){
+        ret = -ENOMEM;
+        goto done;
+    }
+    ret = scull_dev_init(tmp);
+    if(ret){
+        kfree(tmp);
+        goto done;
+    }
+    cur = NULL;
+    cur_item = -1;
+
+    down_write(&dev->rwsem);
+
+    tmp->quantum = dev->reshape_quantum;
+    tmp->qset = dev->reshape_qset;
+    tmp->layout = dev->layout;
+    tmp->backing = dev->backing;
+    tmp->numa_policy = dev->numa_policy;
+    tmp->numa_node = dev->numa_node;
+    move = tmp->quantum == dev->quantum;
+
+    // 没有 slab 的设备(例如 scullpriv)继续用 kmalloc;只搬量子时不需要新的量子 slab
+    scull_alt_name(tmp->qset_cache_name , dev->qset_cache_name , sizeof(tmp->qset_cache_name));
+    scull_alt_name(tmp->quantum_cache_name , dev->quantum_cache_name , sizeof(tmp->quantum_cache_name));
+    if(dev->qset_cache && !move)
+        scull_create_caches(tmp);
+    else if(dev->qset_cache)
+        tmp->qset_cache = kmem_cache_create(tmp->qset_cache_name , tmp->qset * sizeof(char *) , 0 , 0 , NULL);
+
+    // 从这里开始的写入都会记下来
+    gen = dev->generation;
+    scull_reshape_take_dirty(dev , &lo , &hi);
+    step = (loff_t)dev->quantum * dev->qset;
+    tail = SCULL_RESHAPE_TAIL * step;
+    dptr = scull_reshape_first(dev , &index);
+
+    /*
+     * 第一遍分配新目录(量子大小不同时连同量子一起拷贝),失败时 dev 完全没有被改动.
+     * 每次只处理一个量子集,中间放开写锁
+     */
+    while(dptr){
+        dptr = scull_reshape_step(dev , tmp , dptr , &index , 0 , &cur , &cur_item , &ret);
+        if(ret)
+            goto fail;
+        up_write(&dev->rwsem);
+        cond_resched();
+        down_write(&dev->rwsem);
+        if(dev->generation != gen)
+            goto again;
     }
 
-    // Then follow the list
-    while(n--){
+    // 量子大小不同: 第一遍期间被写过的量子要重新拷贝,同样分步进行,直到剩下的不多
+    for(round = 0; !move && round < SCULL_RESHAPE_ROUNDS; round++){
+        if(dev->reshape_hi - dev->reshape_lo <= tail)
+            break;
+        scull_reshape_take_dirty(dev , &lo , &hi);
+        up_write(&dev->rwsem);
+
+        for(; lo < hi; lo += step){
+            down_write(&dev->rwsem);
+            if(dev->generation != gen)
+                goto again;
+            ret = scull_reshape_range(dev , tmp , lo , min_t(loff_t , hi , lo + step) , &cur , &cur_item);
+            if(ret)
+                goto fail;
+            up_write(&dev->rwsem);
+            cond_resched();
+        }
 
-        if( !qs->next){
-            qs->next = kmalloc(sizeof(struct scull_qset) , GFP_KERNEL);
-            if(qs->next == NULL)
-                return NULL;
-            
-            memset(qs->next , 0, sizeof(struct scull_qset));
+        down_write(&dev->rwsem);
+        if(dev->generation != gen)
+            goto again;
+    }
+
+    // 最后一步一直持有写锁: 补完剩下的部分,然后交换;缺页处理也要等交换完成
+    down_write(&dev->fault_sem);
+    if(move){
+        // 只是把量子指针放进新目录,不拷贝数据;第一遍之后新出现的量子集在这里补上目录
+        ret = scull_reshape_fill(dev , tmp , 1);
+        if(ret){
+            scull_forget_quanta(tmp);
+            goto fail_swap;
         }
+    }else{
+        scull_reshape_take_dirty(dev , &lo , &hi);
+        ret = scull_reshape_range(dev , tmp , lo , hi , &cur , &cur_item);
+        if(ret)
+            goto fail_swap;
+    }
 
-        qs = qs->next;
-        continue;
+    // 已经提交的延迟释放还按旧参数工作,必须在交换之前完成
+    scull_flush_deferred(dev);
+
+    preempt_disable();
+    write_seqcount_begin(&dev->geom_seq);
+    swap(dev->data , tmp->data);
+    swap(dev->qsets , tmp->qsets);
+    swap(dev->quantum , tmp->quantum);
+    swap(dev->qset , tmp->qset);
+    swap(dev->qset_cache , tmp->qset_cache);
+    if(!move){
+        swap(dev->quantum_cache , tmp->quantum_cache);
+        swap(dev->pool , tmp->pool);
+        swap(dev->pool_count , tmp->pool_count);
+        atomic_long_set(&tmp->nr_quanta , atomic_long_xchg(&dev->nr_quanta , atomic_long_read(&tmp->nr_quanta)));
+        swap(dev->node_bytes , tmp->node_bytes);
     }
+    // 和目录一起换: 拿到新 seq 的读者不会再用旧目录里缓存的游标
+    scull_bump_generation(dev);
+    write_seqcount_end(&dev->geom_seq);
+    preempt_enable();
+    up_write(&dev->fault_sem);
+
+    memcpy(dev->qset_cache_name , tmp->qset_cache_name , sizeof(dev->qset_cache_name));
+    if(!move)
+        memcpy(dev->quantum_cache_name , tmp->quantum_cache_name , sizeof(dev->quantum_cache_name));
+    dev->custom_geometry = 1;
+    up_write(&dev->rwsem);
+
+    // 旧目录可能还有 RCU 读者在访问
+    if(dev->lock_mode == SCULL_LOCK_RCU)
+        synchronize_srcu(&dev->srcu);
+    if(move)
+        scull_forget_quanta(tmp);
+    scull_free_dir(tmp);
+    goto destroy;
+
+again:
+    // 放开写锁期间有人 trim 了设备,几何参数也可能变了,丢掉已经排好的部分从头再来
+    up_write(&dev->rwsem);
+    scull_free_dir(tmp);
+    scull_dev_destroy(tmp);
+    kfree(tmp);
+    goto restart;
+
+fail_swap:
+    up_write(&dev->fault_sem);
+fail:
+    up_write(&dev->rwsem);
+    scull_free_dir(tmp);
+
+destroy:
+    scull_dev_destroy(tmp);
+    kfree(tmp);
+done:
+    WRITE_ONCE(dev->reshape_status , ret);
+    clear_bit(0 , &dev->reshaping);
+}
 
-    return qs;
+static int scull_reshape(struct scull_dev* dev , struct scull_geometry* geo){
+    if(geo->quantum < (int)sizeof(void *) || geo->qset <= 0 || geo->quantum > INT_MAX / geo->qset)
+        return -EINVAL;
 
+    // 页面模式的量子必须是一个复合页
+    if(dev->backing == SCULL_BACKING_PAGE && !scull_page_quantum_ok(geo->quantum))
+        return -EINVAL;
+    // 现有的数据在新的几何参数下要能表示;工作期间继续写入的部分由 scull_reshape_quantum 检查
+    if(READ_ONCE(dev->size) > scull_max_pos(geo->quantum * geo->qset))
+        return -EFBIG;
+
+    if(!scull_wq)
+        return -ENOMEM;
+    if(test_and_set_bit(0 , &dev->reshaping))
+        return -EBUSY;
+
+    dev->reshape_quantum = geo->quantum;
+    dev->reshape_qset = geo->qset;
+    WRITE_ONCE(dev->reshape_status , 1);
+    queue_work(scull_wq , &dev->reshape_work);
+    return 0;
+}
 
+// 绑定的节点必须存在并且有内存
+static int scull_numa_valid(int policy , int node){
+    if(policy == SCULL_NUMA_BIND)
+        return node >= 0 && node < nr_node_ids && node_state(node , N_MEMORY);
+    return policy == SCULL_NUMA_LOCAL || policy == SCULL_NUMA_INTERLEAVE;
 }
 
-long scull_ioctl(struct file* filp , unsigned int cmd , unsigned long arg){
+// SCULL_IOCINFO 的快照,调用者持有设备锁,各项数据才是同一时刻的
+static void scull_get_info(struct scull_dev* dev , struct scull_info* info){
+    memset(info , 0 , sizeof(*info));
+    info->quantum = dev->quantum;
+    info->qset = dev->qset;
+    info->size = READ_ONCE(dev->size);
+    info->nr_quanta = atomic_long_read(&dev->nr_quanta);
+    info->pending_bytes = atomic_long_read(&dev->pending_bytes);
+    info->pool_hits = atomic_long_read(&dev->pool_hits);
+    info->pool_misses = atomic_long_read(&dev->pool_misses);
+}
 
-    int err = 0 , tmp ;
+/*
+ * 执行一条 ioctl 命令,SCULL_IOCBATCH 对每一项都调用它.
+ * 调用时不持有设备锁: __get_user/copy_to_user 可能缺页,而参数可能正指向本设备的映射,
+ * 缺页处理和读写路径的加锁顺序见 scull_vma_fault.
+ * SCULL_IOCINFO 只把调用者事先取得的快照 info 拷给用户
+ */
+static long scull_ioctl_one(struct scull_dev* dev , unsigned int cmd , unsigned long arg ,
+                            const struct scull_info* info){
+
+    struct scull_geometry geo;
+    struct scull_numa numa;
+    int err = 0 , tmp , val; // 设置全局参数时先放在 val 里检查,非正数会让 trim 除以 0
     int retval = 0;
 
     // 错误指令
     if(_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
     if(_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
 
-	if (_IOC_DIR(cmd) & _IOC_READ)
-		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-	else if (_IOC_DIR(cmd) & _IOC_WRITE)
-		err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
+	// 5.0 起 access_ok 不再区分读写方向
+	if (_IOC_DIR(cmd) & (_IOC_READ | _IOC_WRITE))
+		err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
 	if (err) return -EFAULT;
 
 	switch(cmd) {
@@ -426,12 +1629,19 @@ long scull_ioctl(struct file* filp , unsigned int cmd , unsigned long arg){
 	  case SCULL_IOCSQUANTUM: /* Set: arg points to the value */
 		if (! capable (CAP_SYS_ADMIN))
 			return -EPERM;
-		retval = __get_user(scull_quantum, (int __user *)arg);
+		retval = __get_user(val, (int __user *)arg);
+		if (retval)
+			break;
+		if (val <= 0)
+			return -EINVAL;
+		scull_quantum = val;
 		break;
 
 	  case SCULL_IOCTQUANTUM: /* Tell: arg is the value */
 		if (! capable (CAP_SYS_ADMIN))
 			return -EPERM;
+		if ((long)arg <= 0 || arg > INT_MAX)
+			return -EINVAL;
 		scull_quantum = arg;
 		break;
 
@@ -446,14 +1656,20 @@ long scull_ioctl(struct file* filp , unsigned int cmd , unsigned long arg){
 		if (! capable (CAP_SYS_ADMIN))
 			return -EPERM;
 		tmp = scull_quantum;
-		retval = __get_user(scull_quantum, (int __user *)arg);
-		if (retval == 0)
-			retval = __put_user(tmp, (int __user *)arg);
+		retval = __get_user(val, (int __user *)arg);
+		if (retval)
+			break;
+		if (val <= 0)
+			return -EINVAL;
+		scull_quantum = val;
+		retval = __put_user(tmp, (int __user *)arg);
 		break;
 
 	  case SCULL_IOCHQUANTUM: /* sHift: like Tell + Query */
 		if (! capable (CAP_SYS_ADMIN))
 			return -EPERM;
+		if ((long)arg <= 0 || arg > INT_MAX)
+			return -EINVAL;
 		tmp = scull_quantum;
 		scull_quantum = arg;
 		return tmp;
@@ -461,12 +1677,19 @@ long scull_ioctl(struct file* filp , unsigned int cmd , unsigned long arg){
 	  case SCULL_IOCSQSET:
 		if (! capable (CAP_SYS_ADMIN))
 			return -EPERM;
-		retval = __get_user(scull_qset, (int __user *)arg);
+		retval = __get_user(val, (int __user *)arg);
+		if (retval)
+			break;
+		if (val <= 0)
+			return -EINVAL;
+		scull_qset = val;
 		break;
 
 	  case SCULL_IOCTQSET:
 		if (! capable (CAP_SYS_ADMIN))
 			return -EPERM;
+		if ((long)arg <= 0 || arg > INT_MAX)
+			return -EINVAL;
 		scull_qset = arg;
 		break;
 
@@ -481,18 +1704,57 @@ long scull_ioctl(struct file* filp , unsigned int cmd , unsigned long arg){
 		if (! capable (CAP_SYS_ADMIN))
 			return -EPERM;
 		tmp = scull_qset;
-		retval = __get_user(scull_qset, (int __user *)arg);
-		if (retval == 0)
-			retval = put_user(tmp, (int __user *)arg);
+		retval = __get_user(val, (int __user *)arg);
+		if (retval)
+			break;
+		if (val <= 0)
+			return -EINVAL;
+		scull_qset = val;
+		retval = put_user(tmp, (int __user *)arg);
 		break;
 
 	  case SCULL_IOCHQSET:
 		if (! capable (CAP_SYS_ADMIN))
 			return -EPERM;
+		if ((long)arg <= 0 || arg > INT_MAX)
+			return -EINVAL;
 		tmp = scull_qset;
 		scull_qset = arg;
 		return tmp;
 
+	  case SCULL_IOCRESHAPE: /* 只影响这一个设备,数据保留 */
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&geo, (void __user *)arg, sizeof(geo)))
+			return -EFAULT;
+		return scull_reshape(dev, &geo);
+
+	  case SCULL_IOCQRESHAPE:
+		return READ_ONCE(dev->reshape_status);
+
+	  case SCULL_IOCSNUMA: /* 只影响之后分配的量子,已有的数据不迁移 */
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (!scull_numa_valid(numa.policy, numa.node))
+			return -EINVAL;
+		WRITE_ONCE(dev->numa_node, numa.node);
+		WRITE_ONCE(dev->numa_policy, numa.policy);
+		break;
+
+	  case SCULL_IOCGNUMA:
+		numa.policy = READ_ONCE(dev->numa_policy);
+		numa.node = READ_ONCE(dev->numa_node);
+		if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_IOCINFO:
+		if (copy_to_user((void __user *)arg, info, sizeof(*info)))
+			return -EFAULT;
+		break;
+
         /*
          * The following two change the buffer size for scullpipe.
          * The scullpipe device uses this same ioctl method, just to
@@ -509,10 +1771,166 @@ long scull_ioctl(struct file* filp , unsigned int cmd , unsigned long arg){
 
 }
 
+// 批量命令不能嵌套
+static long scull_ioctl_batch(struct scull_dev* dev , unsigned long arg){
+    struct scull_ioc_batch batch;
+    struct scull_ioc_entry* ent;
+    struct scull_info info;
+    long retval = 0;
+    unsigned int i;
+    int idx = 0 , snap = 0;
+
+    if(copy_from_user(&batch , (void __user *)arg , sizeof(batch)))
+        return -EFAULT;
+    if(batch.count > SCULL_IOC_BATCH_MAX)
+        return -EINVAL;
+
+    ent = memdup_user(u64_to_user_ptr(batch.entries) , batch.count * sizeof(*ent));
+    if(IS_ERR(ent))
+        return PTR_ERR(ent);
+
+    // 只有 SCULL_IOCINFO 需要设备锁,整批共用一次加锁取得的快照
+    for(i = 0; i < batch.count; i++)
+        snap |= ent[i].cmd == SCULL_IOCINFO;
+    if(snap){
+        if(scull_lock_read(dev , &idx , 0)){
+            kfree(ent);
+            return -ERESTARTSYS;
+        }
+        scull_get_info(dev , &info);
+        scull_unlock_read(dev , idx);
+    }
+
+    for(i = 0; i < batch.count; i++){
+        if(ent[i].cmd == SCULL_IOCBATCH)
+            ent[i].result = -EINVAL;
+        else
+            ent[i].result = scull_ioctl_one(dev , ent[i].cmd , (unsigned long)ent[i].arg , &info);
+    }
+
+    if(copy_to_user(u64_to_user_ptr(batch.entries) , ent , batch.count * sizeof(*ent)))
+        retval = -EFAULT;
+    kfree(ent);
+    return retval;
+}
+
+long scull_ioctl(struct file* filp , unsigned int cmd , unsigned long arg){
+    struct scull_dev* dev = scull_file_dev(filp);
+    struct scull_info info;
+    int idx = 0;
+
+    switch(cmd){
+      case SCULL_IOCBATCH:
+        return scull_ioctl_batch(dev , arg);
+
+      case SCULL_IOCINFO:
+        // 加锁取快照,拷给用户时已经放开了锁
+        if(scull_lock_read(dev , &idx , 0))
+            return -ERESTARTSYS;
+        scull_get_info(dev , &info);
+        scull_unlock_read(dev , idx);
+        return scull_ioctl_one(dev , cmd , arg , &info);
+    }
+    return scull_ioctl_one(dev , cmd , arg , NULL);
+}
+
 
 // 重新定位文件位置
+/**
+ * SEEK_DATA/SEEK_HOLE: 从 pos 开始找第一个有数据(want_data)或者是空洞的位置,粒度是量子
+ * 索引布局下整段缺失的量子集用 xa_find 直接跳过
+ */
+static loff_t scull_seek_data_hole(struct scull_dev* dev , loff_t pos , int want_data){
+    int quantum , qset;
+    int itemsize;
+    struct scull_qset* dptr = NULL;
+    struct xarray* qsets;
+    unsigned long size , index;
+    int item , s_pos , rest;
+    int cur_item = -1;
+    unsigned int seq;
+    void** data;
+    int present , idx = 0;
+    loff_t retval;
+
+    if(scull_lock_read(dev , &idx , 0))
+        return -ERESTARTSYS;
+
+    seq = read_seqcount_begin(&dev->geom_seq);
+    quantum = dev->quantum;
+    qset = dev->qset;
+    itemsize = quantum * qset;
+
+    size = READ_ONCE(dev->size);
+    if(pos >= size){
+        retval = -ENXIO;
+        goto out;
+    }
+
+    while(pos < size){
+        if(pos >= scull_max_pos(itemsize))
+            break;
+        item = (long)pos / itemsize;
+        rest = (long)pos % itemsize;
+        s_pos = rest / quantum;
+
+        if(item != cur_item){
+            // 链表布局下顺着 next 走,不必每次从表头开始
+            if(dev->layout == SCULL_LAYOUT_LIST && dptr && item == cur_item + 1)
+                dptr = smp_load_acquire(&dptr->next);
+            else
+                dptr = scull_lookup(dev , item);
+            cur_item = item;
+
+            // 和 scull_read_iter 一样,几何参数被换掉后按新参数重新定位
+            if(read_seqcount_retry(&dev->geom_seq , seq)){
+                seq = read_seqcount_begin(&dev->geom_seq);
+                quantum = dev->quantum;
+                qset = dev->qset;
+                itemsize = quantum * qset;
+                dptr = NULL;
+                cur_item = -1;
+                continue;
+            }
+        }
+
+        if(want_data && !dptr && dev->layout == SCULL_LAYOUT_INDEX){
+            qsets = smp_load_acquire(&dev->qsets);
+            index = item;
+            if(!xa_find(qsets , &index , ULONG_MAX , XA_PRESENT))
+                break;
+            if(read_seqcount_retry(&dev->geom_seq , seq)){
+                cur_item = -1;
+                continue;
+            }
+            pos = max_t(loff_t , pos , (loff_t)index * itemsize);
+            continue;
+        }
+
+        data = dptr ? smp_load_acquire(&dptr->data) : NULL;
+        present = data && READ_ONCE(data[s_pos]);
+        if(present == want_data){
+            retval = pos;
+            goto out;
+        }
+
+        // 整个量子集缺失就跳到下一个量子集,否则跳到下一个量子
+        if(!data)
+            pos = (loff_t)(item + 1) * itemsize;
+        else
+            pos = (pos / quantum + 1) * quantum;
+    }
+
+    // 没有更多数据了;而设备末尾总被看作一个空洞
+    retval = want_data ? -ENXIO : size;
+
+out:
+    scull_unlock_read(dev , idx);
+    return retval;
+}
+
 loff_t scull_llseek(struct file* filp, loff_t off , int where){
-    struct scull_dev* dev = filp->private_data;
+    struct scull_dev* dev = scull_file_dev(filp);
     loff_t new_pos;
 
     switch(where){
@@ -525,12 +1943,22 @@ loff_t scull_llseek(struct file* filp, loff_t off , int where){
         case 2: // SEEK_END
             new_pos = dev->size + off;
             break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            if(off < 0)
+                return -ENXIO;
+            new_pos = scull_seek_data_hole(dev , off , where == SEEK_DATA);
+            if(new_pos < 0)
+                return new_pos;
+            break;
         default:
             return -EINVAL;
     }
 
     if(new_pos < 0)
         return -EINVAL;
+    if(new_pos > scull_max_pos(READ_ONCE(dev->quantum) * READ_ONCE(dev->qset)))
+        return -EFBIG;
     filp->f_pos = new_pos;
     return new_pos;
 
@@ -538,6 +1966,181 @@ loff_t scull_llseek(struct file* filp, loff_t off , int where){
 }
 
 
+/*
+ * mmap: 只有页面模式的设备支持.缺页时才去查找(必要时分配)对应的量子页,
+ * 用户空间随后直接访问设备内容,不再经过 read()/write() 拷贝
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault* vmf){
+    struct scull_dev* dev = vmf->vma->vm_private_data;
+    struct scull_qset* dptr;
+    vm_fault_t retval = VM_FAULT_SIGBUS;
+    loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+    int item , s_pos , rest;
+    void** data;
+    void* q;
+
+    /*
+     * 这里已经持有 mmap_lock,而读写路径持有 rwsem 和分条锁时会在拷贝用户内存时缺页,
+     * 所以不能拿它们: 两边顺序相反会死锁,read(fd, 同一设备的映射, n) 更是会锁住自己.
+     * 只拿 fault_sem 的读锁,持有它期间 trim/reshape 不会换掉目录和几何参数;
+     * 和写者同时补同一个空位由 scull_get_qarray/scull_get_quantum 处理
+     */
+    down_read(&dev->fault_sem);
+
+    // trim 之后设备可能已经不是页面模式了
+    if(dev->backing != SCULL_BACKING_PAGE)
+        goto out;
+    if(pos >= READ_ONCE(dev->size) || pos >= scull_max_pos(dev->quantum * dev->qset))
+        goto out;
+
+    // 量子是复合页时,缺页的这一页是量子里的第 rest / PAGE_SIZE 个子页
+    item = (long)pos / ((long)dev->quantum * dev->qset);
+    rest = (long)pos % ((long)dev->quantum * dev->qset);
+    s_pos = rest / dev->quantum;
+
+    retval = VM_FAULT_OOM;
+    dptr = scull_follow(dev , item , GFP_KERNEL);
+    if(!dptr)
+        goto out;
+    data = scull_get_qarray(dev , dptr , GFP_KERNEL);
+    if(!data)
+        goto out;
+    // 稀疏区域第一次被访问时补上一个清零的页
+    q = scull_get_quantum(dev , &data[s_pos] , GFP_KERNEL);
+    if(!q)
+        goto out;
+
+    vmf->page = virt_to_page(q + rest % dev->quantum);
+    get_page(vmf->page);
+    retval = 0;
+
+out:
+    up_read(&dev->fault_sem);
+    return retval;
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+    .fault = scull_vma_fault,
+};
+
+int scull_mmap(struct file* filp , struct vm_area_struct* vma){
+    struct scull_dev* dev = scull_file_dev(filp);
+
+    if(dev->backing != SCULL_BACKING_PAGE)
+        return -ENODEV;
+
+    vma->vm_ops = &scull_vm_ops;
+    scull_vm_flags_set(vma , VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_private_data = dev;
+    return 0;
+}
+
+/*
+ * splice/sendfile: 页面模式下量子就是整页,直接把量子所在的页挂进管道,数据不经过任何拷贝.
+ * 管道持有页的引用,之后的 trim 不会让它失效;和 mmap 一样,之后对同一位置的写入在管道里可见.
+ * 空洞挂上零页.其他模式的量子不是整页,退回通用实现,经 scull_read_iter 拷贝一次
+ */
+static void scull_spd_release(struct splice_pipe_desc* spd , unsigned int i){
+    put_page(spd->pages[i]);
+}
+
+/*
+ * 5.8 起 ->confirm 和 ->try_steal 都是可选的: 量子页一直是最新的,不需要 confirm;
+ * 不提供 try_steal,管道的读者不能把设备的页偷走
+ */
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get     = generic_pipe_buf_get,
+};
+
+ssize_t scull_splice_read(struct file* in , loff_t* ppos , struct pipe_inode_info* pipe , size_t len , unsigned int flags){
+    struct scull_file* sf = in->private_data;
+    struct scull_dev* dev = sf->dev;
+    struct page* pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .ops = &scull_pipe_buf_ops,
+        .spd_release = scull_spd_release,
+    };
+    struct scull_qset* dptr = NULL;
+    loff_t pos = *ppos;
+    int quantum , itemsize , item , rest , s_pos , q_pos;
+    int cur_item = -1 , idx = 0;
+    unsigned long size;
+    unsigned int seq;
+    struct page* page;
+    size_t chunk;
+    void** data;
+    void* q;
+    ssize_t retval;
+
+    if(READ_ONCE(dev->backing) != SCULL_BACKING_PAGE)
+        return generic_file_splice_read(in , ppos , pipe , len , flags);
+
+    if(scull_lock_read(dev , &idx , 0))
+        return -ERESTARTSYS;
+
+    // 加锁之后再确认一次: trim 可能刚刚换掉了量子来源
+    seq = read_seqcount_begin(&dev->geom_seq);
+    if(dev->backing != SCULL_BACKING_PAGE){
+        scull_unlock_read(dev , idx);
+        return generic_file_splice_read(in , ppos , pipe , len , flags);
+    }
+    quantum = dev->quantum;
+    itemsize = quantum * dev->qset;
+
+    size = READ_ONCE(dev->size);
+    if(pos < size)
+        len = min_t(size_t , len , size - pos);
+    else
+        len = 0;
+
+    while(len && spd.nr_pages < PIPE_DEF_BUFFERS){
+        item = (long)pos / itemsize;
+        rest = (long)pos % itemsize;
+        s_pos = rest / quantum;
+        q_pos = rest % quantum;
+
+        if(item != cur_item){
+            scull_switch_stripe(dev , cur_item , item , 0 , 0);
+            dptr = scull_cursor_get(sf , item , 0);
+            cur_item = item;
+
+            // 几何参数或量子来源变了,先把已经收集到的页交出去
+            if(read_seqcount_retry(&dev->geom_seq , seq))
+                break;
+        }
+
+        data = dptr ? smp_load_acquire(&dptr->data) : NULL;
+        q = data ? smp_load_acquire(&data[s_pos]) : NULL;
+
+        // 量子可能是复合页,挂进管道的是其中的一个子页
+        page = q ? virt_to_page(q + q_pos) : ZERO_PAGE(0);
+        chunk = min_t(size_t , len , PAGE_SIZE - offset_in_page(q_pos));
+        get_page(page);
+
+        pages[spd.nr_pages] = page;
+        partial[spd.nr_pages].offset = offset_in_page(q_pos);
+        partial[spd.nr_pages].len = chunk;
+        spd.nr_pages++;
+
+        pos += chunk;
+        len -= chunk;
+    }
+
+    scull_switch_stripe(dev , cur_item , -1 , 0 , 0);
+    scull_unlock_read(dev , idx);
+
+    // 管道满或者没有读者时 splice_to_pipe 只接收一部分,其余的页由 scull_spd_release 释放
+    retval = spd.nr_pages ? splice_to_pipe(pipe , &spd) : 0;
+    if(retval > 0)
+        *ppos += retval;
+    return retval;
+}
+
 
 int scull_init_module(void){
     int res , i;
@@ -568,14 +2171,58 @@ int scull_init_module(void){
 
     memset(scull_devices , 0, scull_nr_devs * sizeof(struct scull_dev));
 
+    // 没有工作队列时 scull_trim 退回同步释放
+    scull_wq = alloc_workqueue("scull_free" , WQ_UNBOUND , 0);
+
+    if(scull_layout != SCULL_LAYOUT_LIST && scull_layout != SCULL_LAYOUT_INDEX)
+        scull_layout = SCULL_LAYOUT_INDEX;
+    if(scull_backing != SCULL_BACKING_SLAB && scull_backing != SCULL_BACKING_PAGE)
+        scull_backing = SCULL_BACKING_SLAB;
+    if(scull_page_order < 0 || scull_page_order > SCULL_MAX_PAGE_ORDER)
+        scull_page_order = 0;
+    if(!scull_numa_valid(scull_numa_policy , scull_numa_node)){
+        scull_numa_policy = SCULL_NUMA_LOCAL;
+        scull_numa_node = 0;
+    }
+    if(scull_lock_mode < SCULL_LOCK_EXCL || scull_lock_mode > SCULL_LOCK_RCU)
+        scull_lock_mode = SCULL_LOCK_EXCL;
+    // scull_trim_qset 要用量子大小去除
+    if(scull_quantum <= 0)
+        scull_quantum = SCULL_QUANTUM;
+    if(scull_qset <= 0)
+        scull_qset = SCULL_QSET;
+
     for(i = 0;i< scull_nr_devs;i++){
-        scull_devices[i].quantum = scull_quantum;
-        scull_devices[i].qset = scull_qset;
-        init_mutex(&scull_devices[i].mutex);
+        scull_devices[i].quantum = scull_default_quantum();
+        scull_devices[i].qset = scull_trim_qset(&scull_devices[i]);
+        scull_devices[i].layout = scull_layout;
+        scull_devices[i].backing = scull_backing;
+        res = scull_dev_init(&scull_devices[i]);
+        if(res){
+            // 只有前 i 个设备完成了初始化,不能交给 scull_cleanup_module
+            while(--i >= 0){
+                cdev_del(&scull_devices[i].cdev);
+                scull_dev_destroy(&scull_devices[i]);
+            }
+            kfree(scull_devices);
+            if(scull_wq)
+                destroy_workqueue(scull_wq);
+            unregister_chrdev_region(MKDEV(scull_major , scull_minor) , scull_nr_devs);
+            return res;
+        }
+        snprintf(scull_devices[i].quantum_cache_name , sizeof(scull_devices[i].quantum_cache_name),
+                "scull%d_quantum" , i);
+        snprintf(scull_devices[i].qset_cache_name , sizeof(scull_devices[i].qset_cache_name),
+                "scull%d_qset" , i);
+        scull_create_caches(&scull_devices[i]);
         scull_setup_cdev(&scull_devices[i], i);
     }
 
+    proc_create("scullmem" , 0 , NULL , &scull_mem_proc_fops);
+
     dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
+    dev += scull_p_init(dev);
+    dev += scull_access_init(dev);
 
 	return 0; /* succeed */
 
@@ -592,18 +2239,25 @@ void scull_cleanup_module(){
     // 丢弃字符设备
     if(scull_devices){
         for(i = 0;i< scull_nr_devs;i++){
+            flush_work(&scull_devices[i].reshape_work);
             scull_trim(scull_devices + i);
+            scull_dev_destroy(scull_devices + i);
             cdev_del(&scull_devices[i].cdev);
         }
         kfree(scull_devices);
     }
 
+    // access.c 的设备 trim 时也会用到 scull_wq
+    scull_access_cleanup();
+    if(scull_wq)
+        destroy_workqueue(scull_wq);
+    remove_proc_entry("scullmem" , NULL);
+
     /* cleanup_module is never called if registering failed */
 	unregister_chrdev_region(devno, scull_nr_devs);
 
 	/* and call the cleanup functions for friend devices */
-	// scull_p_cleanup();
-	// scull_access_cleanup();
+	scull_p_cleanup();
 
 }
 
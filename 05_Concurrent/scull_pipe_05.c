@@ -1,170 +1,1429 @@
-
 // 用pipe实现
 
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk(), min() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>	/* vmalloc_user() */
+#include <linux/mm.h>		/* remap_vmalloc_range() */
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+#include <linux/timekeeping.h>	/* ktime_get_ns() */
+#include <linux/jiffies.h>
+#include <linux/timer.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/fcntl.h>
+#include <linux/poll.h>
+#include <linux/cdev.h>
+#include <linux/semaphore.h>
+#include <linux/mutex.h>
+#include <linux/uio.h>		/* iov_iter */
+#include <linux/uaccess.h>	/* copy_*_user */
+#include <linux/splice.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/capability.h>
 
 #include "scull_05.h"
 
 
+/*
+ * 分片模式下每个 CPU 的环.大小是 2 的幂,head/tail 是自由增长的计数,
+ * 写者只改 head,读者只改 tail,和共享的环一样用 acquire/release 交接
+ */
+struct scull_p_shard {
+    struct mutex lock;         // 同一个 CPU 上的写者之间互斥,读者不拿
+    char* buffer;
+    unsigned int mask;         // 大小减一
+    unsigned int head , tail;
+} ____cacheline_aligned_in_smp;
+
+// 分片里每条记录的头
+struct scull_p_rec {
+    u32 len;
+    u32 pad;
+    u64 ts;     // 写入的时间,SCULL_P_SHARD_TS 按它合并
+};
+
 // 包括两个等待队列和一个缓冲区
 struct scull_pipe{
-    
+
     wait_queue_head_t inq , outq; // 读取和写入序列
     char *buffer , *end;  // 缓冲区的起始和结尾
-    int buffersize;  // 用于指针运算
-    char *rp , *wq;  // 读取和写入的位置
+    int buffersize;  // 用于指针运算;没有人打开时记录下次分配的大小
+    /*
+     * 读取和写入的位置放在可以 mmap 给用户空间的头部页里(tail 和 head),
+     * 数据区紧跟在它后面.没有加锁的检查在 RCU 读临界区里访问 ring,
+     * scull_p_resize 换掉它之后等一个宽限期再释放
+     */
+    struct scull_p_ring* ring;
+    atomic_t nmaps;          // 映射的数量,不为 0 时不能调整大小
+    unsigned long resizing;  // 第 0 位: 正在调整大小,新的 mmap 失败
     int nreaders , nwriters; // 读写、打开的数量
     struct fasync_struct* async_queue; // 异步读取者
+    /*
+     * SIGIO 的合并,见 scull_p_notify.这几个成员都不加锁,
+     * 模式切换的瞬间多发或少合并一个信号无关紧要
+     */
+    int sigio;                         // SCULL_P_SIGIO_*
+    unsigned long sigio_interval;      // SCULL_P_SIGIO_INTERVAL 的间隔,单位 jiffies
+    unsigned long sigio_last;          // 上一次发信号的时间
+    unsigned long sigio_armed;         // 第 0 位: SCULL_P_SIGIO_EDGE 下次变成可读时发信号
+    atomic_long_t sigio_suppressed;    // 被合并掉的信号数
+    struct timer_list sigio_timer;     // 间隔结束时补发被合并的信号
+    int lowat;  // 读者的最小批量,见 SCULL_P_IOCSLOWAT
+    int packet; // SCULL_P_PACKET 等标志,和 spsc 一样只在持有 mode_sem 的写锁时改变
+    int sharded;                               // SCULL_P_SHARD_*,同上
+    struct scull_p_shard __percpu* shards;     // 第一次开启时分配,一直保留到模块卸载
+    int shard_next;                            // 轮流读取时下一个分片
     struct semaphore sem ;  // 互斥信号量
     struct cdev cdev;  // 字符设备结构
 
+    /*
+     * SPSC 模式: 只有一个读者和一个写者时,读者只修改 rp、写者只修改 wp,
+     * 双方用 acquire/release 交接数据,不再共享 sem.
+     * rlock/wlock 只挡住共用同一个 filp 的多个线程,读写双方各用各的.
+     * spsc 只在持有 mode_sem 的写锁时改变;读写路径持有它的读锁,
+     * 每个 CPU 一个计数器,读写双方不会碰同一个缓存行
+     */
+    int spsc;
+    struct mutex rlock , wlock;
+    struct mutex mode_mutex;   // 串行化模式切换
+    struct percpu_rw_semaphore mode_sem;
+
+};
+
+// 参数
+static int scull_p_nr_devs = SCULL_P_NR_DEVS; // 管道设备的数量
+int scull_p_buffer = SCULL_P_BUFFER;          // 缓冲区的默认大小,可以按设备调整
+dev_t scull_p_devno;                          // 第一个管道设备的设备号
+
+static int scull_p_spsc = 1;                  // 一读一写时是否走无锁路径
+static int scull_p_lowat = 1;                 // 读者最小批量的默认值
+static int scull_p_shard = SCULL_P_SHARD_OFF; // 所有设备一开始的分片模式
+static int scull_p_shard_size = 16384;        // 每个分片的大小,向上取 2 的幂
+static int scull_p_sigio = SCULL_P_SIGIO_EVERY; // 所有设备一开始的 SIGIO 合并方式
+static int scull_p_sigio_ms = 10;             // SCULL_P_SIGIO_INTERVAL 的默认间隔
+static int scull_p_user_max = SCULL_P_USER_BUFFER; // 普通用户用 SCULL_P_IOCTSIZE 能设置的最大缓冲区
+
+module_param(scull_p_nr_devs , int , 0);
+module_param(scull_p_buffer , int , 0);
+module_param(scull_p_spsc , int , 0);
+module_param(scull_p_lowat , int , 0);
+module_param(scull_p_shard , int , 0);
+module_param(scull_p_shard_size , int , 0);
+module_param(scull_p_sigio , int , 0);
+module_param(scull_p_sigio_ms , int , 0);
+module_param(scull_p_user_max , int , 0);
+
+static struct scull_pipe* scull_p_devices;
+
+static int scull_p_fasync(int fd , struct file* filp , int mode);
+
+// 头部页和数据区一起分配,vmalloc_user 得到清零的、可以映射给用户的内存
+static struct scull_p_ring* scull_p_alloc_ring(int size){
+    struct scull_p_ring* ring = vmalloc_user(PAGE_SIZE + size);
+
+    if(ring)
+        ring->size = size;
+    return ring;
 }
 
-// 这里的read()支持阻塞性和非阻塞性输入
-static ssize_t scull_p_read(struct file* filp , char __user* buf , size_t count, loff_t* f_pos){
-    struct scull_pipe* dev = filp->private_data;
+static inline char* scull_p_data(struct scull_p_ring* ring){
+    return (char*)ring + PAGE_SIZE;
+}
+
+/*
+ * 在读写者数量变化后决定是否进入 SPSC 模式.
+ * 读写路径先拿 mode_sem 再拿 sem,所以这里不能在持有 sem 时调用
+ */
+static void scull_p_update_mode(struct scull_pipe* dev){
+    int spsc;
+
+    mutex_lock(&dev->mode_mutex);
+    spsc = scull_p_spsc && READ_ONCE(dev->nreaders) <= 1 && READ_ONCE(dev->nwriters) <= 1;
+    if(spsc != dev->spsc){
+        // 等正在读写的人离开;之后新来的都会看到新的模式
+        percpu_down_write(&dev->mode_sem);
+        dev->spsc = spsc;
+        percpu_up_write(&dev->mode_sem);
+    }
+    mutex_unlock(&dev->mode_mutex);
+}
+
+/*
+ * 读写路径的加锁: SPSC 模式和分片模式下只锁本侧的 rlock/wlock,否则锁 sem.
+ * 持有 mode_sem 的读锁期间 dev->spsc 不会变,解锁时据此选择同一把锁
+ */
+static int scull_p_lock(struct scull_pipe* dev , struct mutex* side){
+    percpu_down_read(&dev->mode_sem);
+    if(dev->spsc || dev->sharded){
+        if(!mutex_lock_interruptible(side))
+            return 0;
+    }else if(!down_interruptible(&dev->sem)){
+        return 0;
+    }
+    percpu_up_read(&dev->mode_sem);
+    return -ERESTARTSYS;
+}
+
+static void scull_p_unlock(struct scull_pipe* dev , struct mutex* side){
+    if(dev->spsc || dev->sharded)
+        mutex_unlock(side);
+    else
+        up(&dev->sem);
+    percpu_up_read(&dev->mode_sem);
+}
+
+/*
+ * head/tail 可能被用户空间改成任意值,使用前先落到数据区内.
+ * 对方写坏了只会读到错误的数据,不会越界
+ */
+static inline unsigned int scull_p_off(int size , unsigned int off){
+    return likely(off < (unsigned int)size) ? off : off % size;
+}
+
+// 以下几个在持有读写路径的锁(因而持有 mode_sem 的读锁)时使用,ring 不会变
+static inline char* scull_p_rp(struct scull_pipe* dev){
+    return dev->buffer + scull_p_off(dev->buffersize , READ_ONCE(dev->ring->tail));
+}
+
+static inline char* scull_p_wp(struct scull_pipe* dev){
+    return dev->buffer + scull_p_off(dev->buffersize , READ_ONCE(dev->ring->head));
+}
+
+// acquire: 看到对方的新位置时,也看得到它之前读写的数据
+static inline char* scull_p_rp_acquire(struct scull_pipe* dev){
+    return dev->buffer + scull_p_off(dev->buffersize , smp_load_acquire(&dev->ring->tail));
+}
+
+static inline char* scull_p_wp_acquire(struct scull_pipe* dev){
+    return dev->buffer + scull_p_off(dev->buffersize , smp_load_acquire(&dev->ring->head));
+}
+
+// release: 对方看到新的位置时,这段数据已经读完(写完)
+static inline void scull_p_set_rp(struct scull_pipe* dev , char* rp){
+    smp_store_release(&dev->ring->tail , (unsigned int)(rp - dev->buffer));
+}
+
+static inline void scull_p_set_wp(struct scull_pipe* dev , char* wp){
+    smp_store_release(&dev->ring->head , (unsigned int)(wp - dev->buffer));
+}
+
+// 给定 rp 和 wp,缓冲区中有多少字节
+static inline int scull_p_used(struct scull_pipe* dev , char* rp , char* wp){
+    return (wp - rp + dev->buffersize) % dev->buffersize;
+}
+
+// 给定 rp 和 wp,还能写入多少字节
+static inline int scull_p_space(struct scull_pipe* dev , char* rp , char* wp){
+    return dev->buffersize - 1 - scull_p_used(dev , rp , wp);
+}
+
+// 指针前进 n 字节,越过 end 时回卷
+static inline char* scull_p_advance(struct scull_pipe* dev , char* p , size_t n){
+    return dev->buffer + (p - dev->buffer + n) % dev->buffersize;
+}
+
+/*
+ * 缓冲区中有多少字节,没有加锁也可以调用(等待条件、poll).
+ * 这时 ring 可能正被 scull_p_resize 换掉,结果不一定准,持锁后会重新检查
+ */
+static int scull_p_count(struct scull_pipe* dev){
+    struct scull_p_ring* ring;
+    int size , head , tail;
+
+    rcu_read_lock();
+    ring = rcu_dereference(dev->ring);
+    if(!ring){
+        // 最后一个文件关闭后缓冲区已经释放,当作空的
+        rcu_read_unlock();
+        return 0;
+    }
+    size = READ_ONCE(dev->buffersize);
+    head = scull_p_off(size , READ_ONCE(ring->head));
+    tail = scull_p_off(size , READ_ONCE(ring->tail));
+    rcu_read_unlock();
+
+    return (head - tail + size) % size;
+}
+
+/*
+ * 分片: 数据区的拷贝和记录头的读写都要处理回卷.
+ * 读者持有 rlock,写者持有分片的 lock,各自只碰自己那一段
+ */
+static void scull_p_shard_peek(struct scull_p_shard* sh , unsigned int pos , void* dst , size_t n){
+    unsigned int off = pos & sh->mask;
+    size_t first = min(n , (size_t)(sh->mask + 1 - off));
+
+    memcpy(dst , sh->buffer + off , first);
+    memcpy((char*)dst + first , sh->buffer , n - first);
+}
+
+static void scull_p_shard_poke(struct scull_p_shard* sh , unsigned int pos , const void* src , size_t n){
+    unsigned int off = pos & sh->mask;
+    size_t first = min(n , (size_t)(sh->mask + 1 - off));
+
+    memcpy(sh->buffer + off , src , first);
+    memcpy(sh->buffer , (const char*)src + first , n - first);
+}
+
+static size_t scull_p_shard_copy_out(struct scull_p_shard* sh , unsigned int pos , size_t n , struct iov_iter* to){
+    unsigned int off = pos & sh->mask;
+    size_t first = min(n , (size_t)(sh->mask + 1 - off));
+    size_t done = copy_to_iter(sh->buffer + off , first , to);
+
+    if(done == first && n > first)
+        done += copy_to_iter(sh->buffer , n - first , to);
+    return done;
+}
+
+static size_t scull_p_shard_copy_in(struct scull_p_shard* sh , unsigned int pos , size_t n , struct iov_iter* from){
+    unsigned int off = pos & sh->mask;
+    size_t first = min(n , (size_t)(sh->mask + 1 - off));
+    size_t done = copy_from_iter(sh->buffer + off , first , from);
+
+    if(done == first && n > first)
+        done += copy_from_iter(sh->buffer , n - first , from);
+    return done;
+}
+
+// 分片还能放下多少字节;没有加锁也可以调用(写者的等待条件)
+static inline unsigned int scull_p_shard_room(struct scull_p_shard* sh){
+    return sh->mask + 1 - (READ_ONCE(sh->head) - READ_ONCE(sh->tail));
+}
+
+/*
+ * 等待读取的总字节数: 共享的环加上分片模式下所有分片(含记录头).
+ * 分片一旦分配就不会释放,没有加锁也可以遍历
+ */
+static int scull_p_pending(struct scull_pipe* dev){
+    struct scull_p_shard* sh;
+    int used = scull_p_count(dev) , cpu;
+
+    if(!READ_ONCE(dev->sharded))
+        return used;
+
+    for_each_possible_cpu(cpu){
+        sh = per_cpu_ptr(dev->shards , cpu);
+        used += READ_ONCE(sh->head) - READ_ONCE(sh->tail);
+    }
+    return used;
+}
+
+static inline int scull_p_empty(struct scull_pipe* dev){
+    return scull_p_pending(dev) == 0;
+}
+
+// 判断有多少空间被释放
+static int spacefree(struct scull_pipe* dev){
+    return READ_ONCE(dev->buffersize) - 1 - scull_p_count(dev);
+}
+
+/*
+ * 读者是否可以被唤醒: 缓冲区里至少有 lowat 字节,或者写者都已关闭而还剩一些数据.
+ * lowat 不超过缓冲区能容纳的字节数,否则永远等不到
+ */
+static int scull_p_readable(struct scull_pipe* dev){
+    int used = scull_p_pending(dev);
+    int lowat = min(READ_ONCE(dev->lowat) , READ_ONCE(dev->buffersize) - 1);
+
+    return used >= lowat || (used && !READ_ONCE(dev->nwriters));
+}
+
+// 写者(或 poll)能否继续: 分片模式下看当前 CPU 的分片能不能再放下一条最短的记录
+static int scull_p_writable(struct scull_pipe* dev){
+    struct scull_p_shard* sh;
+
+    if(!READ_ONCE(dev->sharded))
+        return spacefree(dev) > 0;
+    sh = per_cpu_ptr(dev->shards , raw_smp_processor_id());
+    return scull_p_shard_room(sh) > sizeof(struct scull_p_rec);
+}
+
+/*
+ * 读者和写者都是独占等待,一次只唤醒一个.被唤醒的人离开时如果还有数据(空间),
+ * 把唤醒传给下一个,所以唤醒的人数跟着数据量走,不会一次叫醒所有人再让大多数人接着睡.
+ * 没有人睡眠时不去碰等待队列的自旋锁.
+ * 唤醒时带上事件的掩码,poll/epoll 只会被它关心的事件叫醒
+ */
+static void scull_p_wake_reader(struct scull_pipe* dev){
+    if(scull_p_readable(dev) && wq_has_sleeper(&dev->inq))
+        wake_up_interruptible_poll(&dev->inq , EPOLLIN | EPOLLRDNORM);
+}
+
+static void scull_p_wake_writer(struct scull_pipe* dev){
+    // 分片模式下写者等的是自己的分片,不是共享的环,而且不是独占等待,一起唤醒各自检查
+    if((READ_ONCE(dev->sharded) || spacefree(dev)) && wq_has_sleeper(&dev->outq))
+        wake_up_interruptible_poll(&dev->outq , EPOLLOUT | EPOLLWRNORM);
+}
+
+/*
+ * 通知异步读取者,写者发布数据之后调用.一连串小的写入会让读者的信号处理函数
+ * 占满 CPU,所以可以合并: SCULL_P_SIGIO_EDGE 只在读者读空之后的第一次发,
+ * SCULL_P_SIGIO_INTERVAL 在间隔内只发一次,被跳过的在间隔结束时由定时器补上
+ */
+static void scull_p_notify(struct scull_pipe* dev){
+    unsigned long next;
+
+    if(!dev->async_queue)
+        return;
+
+    switch(READ_ONCE(dev->sigio)){
+
+    case SCULL_P_SIGIO_EDGE:
+        // 先发布数据再看标志,和 scull_p_sigio_arm 的"先装上再看数据"配对
+        smp_mb();
+        if(!scull_p_readable(dev))
+            return;
+        if(!test_and_clear_bit(0 , &dev->sigio_armed)){
+            atomic_long_inc(&dev->sigio_suppressed);
+            return;
+        }
+        break;
+
+    case SCULL_P_SIGIO_INTERVAL:
+        if(!scull_p_readable(dev))
+            return;
+        next = READ_ONCE(dev->sigio_last) + READ_ONCE(dev->sigio_interval);
+        if(time_before(jiffies , next)){
+            atomic_long_inc(&dev->sigio_suppressed);
+            timer_reduce(&dev->sigio_timer , next);
+            return;
+        }
+        WRITE_ONCE(dev->sigio_last , jiffies);
+        break;
+
+    default:
+        if(!scull_p_readable(dev))
+            return;
+    }
+
+    kill_fasync(&dev->async_queue , SIGIO , POLL_IN);
+}
+
+/*
+ * SCULL_P_SIGIO_EDGE: 读者把缓冲区读空了,下一次变成可读时再发信号.
+ * 装上之后再检查一次,期间写入的数据不会因为写者没看到标志而没有通知
+ */
+static void scull_p_sigio_arm(struct scull_pipe* dev){
+    if(READ_ONCE(dev->sigio) != SCULL_P_SIGIO_EDGE || test_bit(0 , &dev->sigio_armed))
+        return;
+    set_bit(0 , &dev->sigio_armed);
+    smp_mb__after_atomic();
+    scull_p_notify(dev);
+}
+
+// 间隔结束: 被合并的写入留下的数据还在,补发一个
+static void scull_p_sigio_timer(struct timer_list* t){
+    struct scull_pipe* dev = from_timer(dev , t , sigio_timer);
+
+    // 最后一个文件关闭时先删掉定时器再释放 ring,这里 ring 一定还在
+    if(dev->async_queue && scull_p_readable(dev)){
+        WRITE_ONCE(dev->sigio_last , jiffies);
+        kill_fasync(&dev->async_queue , SIGIO , POLL_IN);
+    }
+}
+
+
+static int scull_p_open(struct inode* inode , struct file* filp){
+    struct scull_pipe* dev;
+
+    dev = container_of(inode->i_cdev , struct scull_pipe , cdev);
+    filp->private_data = dev;
 
     if(down_interruptible(&dev->sem))
         return -ERESTARTSYS;
 
-    // 无数据读取
-    while(dev->rp == dev->wp){
+    if(!dev->ring){
+        // 第一次打开时才分配缓冲区,大小可能已经被 SCULL_P_IOCTSIZE 改过
+        dev->ring = scull_p_alloc_ring(dev->buffersize);
+        if(!dev->ring){
+            up(&dev->sem);
+            return -ENOMEM;
+        }
+        dev->buffer = scull_p_data(dev->ring);
+        dev->end = dev->buffer + dev->buffersize; // head 和 tail 都是 0,从头开始读写
+    }
+
+    // 用 f_mode 而不是 f_flags 判断读写方式
+    if(filp->f_mode & FMODE_READ)
+        dev->nreaders++;
+    if(filp->f_mode & FMODE_WRITE)
+        dev->nwriters++;
+    up(&dev->sem);
+
+    // open 返回之前这个 filp 还不能读写,模式一定来得及切换
+    scull_p_update_mode(dev);
+
+    return nonseekable_open(inode , filp);
+}
+
+static int scull_p_release(struct inode* inode , struct file* filp){
+    struct scull_pipe* dev = filp->private_data;
+    struct scull_p_ring* old = NULL;
+
+    // 从异步通知列表中删除该 filp
+    scull_p_fasync(-1 , filp , 0);
+    down(&dev->sem);
+    if(filp->f_mode & FMODE_READ)
+        dev->nreaders--;
+    if(filp->f_mode & FMODE_WRITE)
+        dev->nwriters--;
+    if(dev->nreaders + dev->nwriters == 0){
+        // 映射持有文件的引用,走到这里时已经没有映射了;定时器会读 ring
+        del_timer_sync(&dev->sigio_timer);
+        old = dev->ring;
+        rcu_assign_pointer(dev->ring , NULL);
+        dev->buffer = NULL; // 其他成员在 open 时重新设置,buffersize 保留
+    }
+    up(&dev->sem);
+
+    if(old){
+        // 和 scull_p_resize 一样,等没有加锁的 scull_p_count 离开旧的 ring 再释放
+        synchronize_rcu();
+        vfree(old);
+    }
+
+    // 最后一个写者走了,不足一批的数据也要交给还在的读者
+    if((filp->f_mode & FMODE_WRITE) && !READ_ONCE(dev->nwriters) && READ_ONCE(dev->nreaders))
+        scull_p_wake_reader(dev);
+
+    scull_p_update_mode(dev);
+    return 0;
+}
+
+// 包模式下每条记录前面的长度头
+#define SCULL_P_HDR sizeof(u32)
+
+// 从 p 开始拷出 n 字节,跨过 end 时回卷到缓冲区开头;返回拷贝的字节数
+static size_t scull_p_copy_out(struct scull_pipe* dev , char* p , size_t n , struct iov_iter* to){
+    size_t first = min(n , (size_t)(dev->end - p));
+    size_t done = copy_to_iter(p , first , to);
+
+    if(done == first && n > first){
+        // 第二段: 回卷到缓冲区开头
+        done += copy_to_iter(dev->buffer , n - first , to);
+    }
+    return done;
+}
+
+static size_t scull_p_copy_in(struct scull_pipe* dev , char* p , size_t n , struct iov_iter* from){
+    size_t first = min(n , (size_t)(dev->end - p));
+    size_t done = copy_from_iter(p , first , from);
+
+    if(done == first && n > first){
+        done += copy_from_iter(dev->buffer , n - first , from);
+    }
+    return done;
+}
+
+// 长度头本身也可能跨过 end
+static u32 scull_p_get_len(struct scull_pipe* dev , char* p){
+    size_t first = min(SCULL_P_HDR , (size_t)(dev->end - p));
+    u32 len;
+
+    memcpy(&len , p , first);
+    memcpy((char*)&len + first , dev->buffer , SCULL_P_HDR - first);
+    return len;
+}
+
+static void scull_p_put_len(struct scull_pipe* dev , char* p , u32 len){
+    size_t first = min(SCULL_P_HDR , (size_t)(dev->end - p));
+
+    memcpy(p , &len , first);
+    memcpy(dev->buffer , (char*)&len + first , SCULL_P_HDR - first);
+}
+
+/*
+ * 包模式的读取,调用者持有读者一侧的锁,rp 到 wp 之间至少有一条完整的记录.
+ * 成功时 *rpp 移到读走的最后一条记录之后
+ */
+static ssize_t scull_p_read_packet(struct scull_pipe* dev , char** rpp , char* wp , struct iov_iter* to){
+    char* rp = *rpp;
+    size_t count = iov_iter_count(to) , used = scull_p_used(dev , rp , wp);
+    size_t len , n , done = 0;
+
+    if(used < SCULL_P_HDR)
+        return -EIO; // 映射的环被写坏了
+
+    if(!(dev->packet & SCULL_P_PACKET_BATCH)){
+        // 一次一条,count 不够时多出的部分丢弃
+        len = min((size_t)scull_p_get_len(dev , rp) , used - SCULL_P_HDR); // 映射的环可能被写坏
+        n = min(count , len);
+        if(scull_p_copy_out(dev , scull_p_advance(dev , rp , SCULL_P_HDR) , n , to) != n)
+            return -EFAULT;
+        *rpp = scull_p_advance(dev , rp , SCULL_P_HDR + len);
+        return n;
+    }
+
+    // 批量: 连同长度头读出尽可能多的完整记录
+    while(used > SCULL_P_HDR){
+        len = SCULL_P_HDR + scull_p_get_len(dev , rp);
+        if(len > used || len > count - done)
+            break;
+        n = scull_p_copy_out(dev , rp , len , to);
+        if(n != len){
+            // 已经拷给用户的完整记录照常返回
+            if(!done)
+                return -EFAULT;
+            break;
+        }
+        done += len;
+        used -= len;
+        rp = scull_p_advance(dev , rp , len);
+    }
+    if(!done)
+        return -EMSGSIZE;
+    *rpp = rp;
+    return done;
+}
+
+static void scull_p_free_shards(struct scull_p_shard __percpu* shards){
+    int cpu;
+
+    if(!shards)
+        return;
+    for_each_possible_cpu(cpu)
+        kfree(per_cpu_ptr(shards , cpu)->buffer);
+    free_percpu(shards);
+}
+
+static int scull_p_alloc_shards(struct scull_pipe* dev){
+    struct scull_p_shard __percpu* shards;
+    struct scull_p_shard* sh;
+    unsigned int size = roundup_pow_of_two(scull_p_shard_size);
+    int cpu;
+
+    // alloc_percpu 返回清零的内存,失败时 kfree(NULL) 也没问题
+    shards = alloc_percpu(struct scull_p_shard);
+    if(!shards)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu){
+        sh = per_cpu_ptr(shards , cpu);
+        mutex_init(&sh->lock);
+        sh->mask = size - 1;
+        // 分片的内存放在它的 CPU 所在的节点上
+        sh->buffer = kmalloc_node(size , GFP_KERNEL , cpu_to_node(cpu));
+        if(!sh->buffer){
+            scull_p_free_shards(shards);
+            return -ENOMEM;
+        }
+    }
+
+    dev->shards = shards;
+    return 0;
+}
+
+/*
+ * 选出下一条要读的记录所在的分片,并取出它的记录头;所有分片都空时返回 NULL.
+ * 调用者持有 rlock,shard_next 和各个分片的 tail 只有它会改
+ */
+static struct scull_p_shard* scull_p_next_shard(struct scull_pipe* dev , struct scull_p_rec* rec){
+    struct scull_p_shard *sh , *best = NULL;
+    struct scull_p_rec r;
+    int i , cpu;
+
+    for(i = 0; i < nr_cpu_ids; i++){
+        cpu = (dev->shard_next + i) % nr_cpu_ids;
+        if(!cpu_possible(cpu))
+            continue;
+        sh = per_cpu_ptr(dev->shards , cpu);
+
+        // acquire: 看到 head 就看得到它之前写入的整条记录
+        if(smp_load_acquire(&sh->head) == sh->tail)
+            continue;
+        scull_p_shard_peek(sh , sh->tail , &r , sizeof(r));
+
+        if(dev->sharded == SCULL_P_SHARD_RR){
+            // 轮流: 取第一个非空的分片,下次从它后面开始
+            dev->shard_next = (cpu + 1) % nr_cpu_ids;
+            *rec = r;
+            return sh;
+        }
+        // 按时间合并: 取记录头最早的那个
+        if(!best || r.ts < rec->ts){
+            best = sh;
+            *rec = r;
+        }
+    }
+    return best;
+}
+
+/*
+ * 分片模式的读取,调用者持有 rlock.返回的格式和共享的环一样:
+ * 流模式下各条记录的数据拼在一起,count 不够时最后一条只读一部分,剩下的留在原处;
+ * 包模式下一次一条,或者 SCULL_P_PACKET_BATCH 时连同长度头返回多条完整的记录
+ */
+static ssize_t scull_p_read_shards(struct scull_pipe* dev , struct iov_iter* to){
+    size_t count = iov_iter_count(to) , done = 0 , want , n;
+    struct scull_p_shard* sh;
+    struct scull_p_rec rec;
+    unsigned int tail;
+    int err = 0;
+
+    while(done < count && (sh = scull_p_next_shard(dev , &rec))){
+        tail = sh->tail;
+
+        if(!(dev->packet & SCULL_P_PACKET)){
+            want = min(count - done , (size_t)rec.len);
+            n = scull_p_shard_copy_out(sh , tail + sizeof(rec) , want , to);
+            done += n;
+            if(n < rec.len){
+                // 只读了一部分: 在剩余数据前面重新放一个记录头,位置正好落在已经读走的部分
+                if(n){
+                    rec.len -= n;
+                    scull_p_shard_poke(sh , tail + n , &rec , sizeof(rec));
+                    smp_store_release(&sh->tail , tail + n);
+                }else{
+                    err = -EFAULT;
+                }
+                break;
+            }
+        }else if(dev->packet & SCULL_P_PACKET_BATCH){
+            want = sizeof(u32) + rec.len;
+            if(want > count - done){
+                err = -EMSGSIZE;
+                break;
+            }
+            n = copy_to_iter(&rec.len , sizeof(u32) , to);
+            if(n == sizeof(u32))
+                n += scull_p_shard_copy_out(sh , tail + sizeof(rec) , rec.len , to);
+            if(n != want){
+                err = -EFAULT;
+                break;
+            }
+            done += want;
+        }else{
+            // 一次一条,多出的部分丢弃
+            want = min(count , (size_t)rec.len);
+            if(scull_p_shard_copy_out(sh , tail + sizeof(rec) , want , to) != want){
+                err = -EFAULT;
+                break;
+            }
+            done = want;
+            smp_store_release(&sh->tail , tail + sizeof(rec) + rec.len);
+            break;
+        }
+
+        // release: 写者看到新的 tail 时,这条记录已经读完
+        smp_store_release(&sh->tail , tail + sizeof(rec) + rec.len);
+    }
+
+    return done ? done : err;
+}
+
+/*
+ * 分片模式的写入: 从 from 取 len 字节作为一条记录放进 sh,只锁这个分片.
+ * 调用者持有 mode_sem 的读锁,返回前释放;放不下时返回 -ENOSPC,由调用者等待后重试
+ */
+static ssize_t scull_p_write_shard(struct scull_pipe* dev , struct scull_p_shard* sh , struct iov_iter* from , size_t len){
+    struct scull_p_rec rec = { .len = len };
+    unsigned int head;
+    ssize_t retval;
+
+    if(mutex_lock_interruptible(&sh->lock)){
+        retval = -ERESTARTSYS;
+        goto out;
+    }
+
+    // acquire 读 tail,保证读者已经读完了要被覆盖的数据
+    head = sh->head;
+    if(sh->mask + 1 - (head - smp_load_acquire(&sh->tail)) < sizeof(rec) + rec.len){
+        retval = -ENOSPC;
+        goto unlock;
+    }
+
+    rec.ts = ktime_get_ns();
+    scull_p_shard_poke(sh , head , &rec , sizeof(rec));
+    if(scull_p_shard_copy_in(sh , head + sizeof(rec) , rec.len , from) != rec.len){
+        retval = -EFAULT;
+        goto unlock;
+    }
+    // release: 读者看到新的 head 时,整条记录已经写好
+    smp_store_release(&sh->head , head + sizeof(rec) + rec.len);
+    retval = rec.len;
+
+unlock:
+    mutex_unlock(&sh->lock);
+out:
+    percpu_up_read(&dev->mode_sem);
+    return retval;
+}
+
+/*
+ * 这里的read()支持阻塞性和非阻塞性输入
+ * 用 iov_iter 实现,read/readv 和 splice(经由通用的 generic_file_splice_read)共用这一份代码,
+ * splice 时数据从环形缓冲区直接拷进管道的页,不经过用户空间
+ */
+static ssize_t scull_p_read_iter(struct kiocb* iocb , struct iov_iter* to){
+    struct file* filp = iocb->ki_filp;
+    struct scull_pipe* dev = filp->private_data;
+    size_t count = iov_iter_count(to);
+    ssize_t done;
+    char *rp , *wp;
+
+    if(scull_p_lock(dev , &dev->rlock))
+        return -ERESTARTSYS;
+
+    // 无数据读取;阻塞的读者要等攒够一批
+    while(scull_p_empty(dev) || (!(filp->f_flags & O_NONBLOCK) && !scull_p_readable(dev))){
         // 释放锁
-        up(&dev->sem);
-        if(filp->flags & O_NONBLOCK)
+        scull_p_unlock(dev , &dev->rlock);
+        if(filp->f_flags & O_NONBLOCK){
+            // 异步读者读到了 EAGAIN,下一次写入要通知它
+            if(scull_p_empty(dev))
+                scull_p_sigio_arm(dev);
             return -EAGAIN;
-        
+        }
+
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
 
-        // 进入睡眠状态
-        if(wait_event_interruptible(&dev->inq , (dev->rp != dev->wp)))
+        // 进入睡眠状态;独占等待,写者一次只唤醒一个读者,被选中却要离开时把唤醒让给下一个
+        if(wait_event_interruptible_exclusive(dev->inq , scull_p_readable(dev))){
+            scull_p_wake_reader(dev);
             return -ERESTARTSYS;
-        
+        }
+
         // 此时并不能判断数据是否可以被获得
         // 但首先获取信号量
-        if(down_interruptible(&dev->sem))
+        if(scull_p_lock(dev , &dev->rlock)){
+            scull_p_wake_reader(dev);
             return -ERESTARTSYS;
-        
+        }
+
     }
 
-    // 判断写区和读区的位置,不要读区到写区,如果写区在读区后方,读区就读到dev的末尾结束
-    if(dev->wq > dev->rq){
-        count = min(count , (size_t)(dev->wq - dev->rp));
-    }else{
-        // 写入指针回卷,返回数据直到dev->end
-        count = min(count , (size_t)(dev->end - dev->rp));
+    if(dev->sharded && !scull_p_count(dev)){
+        // 共享的环读空了(开启分片模式之前写入的先读),再从分片取
+        done = scull_p_read_shards(dev , to);
+        scull_p_unlock(dev , &dev->rlock);
+        if(done < 0)
+            return done;
+        goto wake;
     }
 
-    // 拷贝开始
-    if(copy_to_user(buf , dev->rp , count)){
+    // rp 只有读者修改;acquire 读 wp,保证看得到写者在移动 wp 之前写入的数据
+    rp = scull_p_rp(dev);
+    wp = scull_p_wp_acquire(dev);
+
+    if(dev->packet & SCULL_P_PACKET){
+        // 写者整条记录一起发布,这里看到的都是完整的记录
+        done = scull_p_read_packet(dev , &rp , wp , to);
+    }else{
+        // 能读多少读多少: 写区在读区前方时数据分成两段,rp 到 end 和 buffer 到 wp
+        count = min(count , (size_t)scull_p_used(dev , rp , wp));
+        // 拷贝开始;splice 时管道满了可能只拷贝一部分
+        done = scull_p_copy_out(dev , rp , count , to);
+        if(!done)
+            done = -EFAULT;
+        else
+            rp = scull_p_advance(dev , rp , done);
+    }
+    if(done < 0){
         // 结束后释放锁
-        up(&dev->sem);
-        return -EFAULT;
+        scull_p_unlock(dev , &dev->rlock);
+        return done;
     }
 
-    dev->rp += count;
-    if(dev->rp == dev->end){
-        // 读到末尾了
-        dev->rp = dev->buffer;
-    }
+    // release: 写者看到新的 rp 时,这段数据已经拷贝完毕,可以覆盖
+    scull_p_set_rp(dev , rp);
 
-    up(&dev->sem);
+    scull_p_unlock(dev , &dev->rlock);
 
-    // 最后 唤醒所有写入者并返回
-    wait_up_interruptible(&dev->outq);
-	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
-    return count;    
+wake:
+    // 最后 唤醒一个写入者,还有剩余数据时再唤醒下一个读者
+    scull_p_wake_writer(dev);
+    scull_p_wake_reader(dev);
+    if(scull_p_empty(dev))
+        scull_p_sigio_arm(dev);
+	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)done);
+    return done;
 
 }
 
-static int scull_getwritespace(struct scull_pipe* dev , struct file* filp){
-    
-    while(spacefree(dev) == 0){
+/*
+ * 等到至少有 need 字节的空间;失败时已经释放了锁.
+ * 包模式的写者 (need > 1) 不做独占等待: 它被叫醒时空间可能仍然不够,
+ * 独占等待会让它吞掉这次唤醒,放得下的小写者却一直睡着.
+ * 非独占的等待者每次都被唤醒,不占用 wake_up 那一个独占名额
+ */
+static int scull_getwritespace(struct scull_pipe* dev , struct file* filp , int need){
+
+    while(spacefree(dev) < need){
         DEFINE_WAIT(wait);
 
-        up(&dev->sem);
+        // 睡眠期间缓冲区可能被 SCULL_P_IOCTSIZE 缩小到放不下这条记录,再等也没有用
+        if(need > READ_ONCE(dev->buffersize) - 1){
+            scull_p_unlock(dev , &dev->wlock);
+            return -EMSGSIZE;
+        }
+
+        scull_p_unlock(dev , &dev->wlock);
         if(filp->f_flags & O_NONBLOCK)
             return -EAGAIN;
 
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
-        prepare_to_wait(&dev->outq , &wait , TASK_INTERRUPTIBLE);
+        if(need > 1)
+            prepare_to_wait(&dev->outq , &wait , TASK_INTERRUPTIBLE);
+        else
+            prepare_to_wait_exclusive(&dev->outq , &wait , TASK_INTERRUPTIBLE);
 
-        if(spacefree(dev) == 0){
+        if(spacefree(dev) < need){
             schedule();
         }
 
         finish_wait(&dev->outq , &wait);
-        if(signal_pending(current))
-            return -ERESTARTSYS;
-        if(down_interruptible(&dev-sem))
+        // 被选中却要离开时,把唤醒让给下一个写者
+        if(signal_pending(current) || scull_p_lock(dev , &dev->wlock)){
+            scull_p_wake_writer(dev);
             return -ERESTARTSYS;
+        }
     }
 
     return 0;
 
 }
-// 判断有多少空间被释放
-static int spacefree(struct scull_pipe* dev){
-    if(dev->rp == dev->wp){
-        return dev->buffersize - 1;
+
+/*
+ * 包模式的写入,调用者持有写者一侧的锁,返回前释放.
+ * 长度头和数据写完之后才移动 wp,读者不会看到半条记录;拷贝失败时什么都没有发布
+ */
+static ssize_t scull_p_write_packet(struct scull_pipe* dev , struct file* filp , struct iov_iter* from){
+    size_t len = iov_iter_count(from);
+    char* wp;
+    int result;
+
+    // 整条记录必须放得进缓冲区
+    if(len + SCULL_P_HDR > dev->buffersize - 1){
+        scull_p_unlock(dev , &dev->wlock);
+        return -EMSGSIZE;
     }
+    if(!len){
+        // 和 O_DIRECT 管道一样,空的写入不产生记录
+        scull_p_unlock(dev , &dev->wlock);
+        return 0;
+    }
+
+    result = scull_getwritespace(dev , filp , len + SCULL_P_HDR);
+    if(result)
+        return result;
+
+    // acquire 读 rp,保证读者已经读完了要被覆盖的数据
+    scull_p_rp_acquire(dev);
+    wp = scull_p_wp(dev);
 
-    return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+    scull_p_put_len(dev , wp , len);
+    if(scull_p_copy_in(dev , scull_p_advance(dev , wp , SCULL_P_HDR) , len , from) != len){
+        scull_p_unlock(dev , &dev->wlock);
+        return -EFAULT;
+    }
+    scull_p_set_wp(dev , scull_p_advance(dev , wp , SCULL_P_HDR + len));
+
+    scull_p_wake_reader(dev);
+    scull_p_unlock(dev , &dev->wlock);
+
+    scull_p_wake_writer(dev);
+    scull_p_notify(dev);
+    return len;
 }
 
-static ssize_t scull_p_write(struct file* filp,const char __user* buf, size_t count, loff_t* f_pos){
+/*
+ * write/writev 和 splice(经由 iter_file_splice_write)共用
+ * 和管道一样,阻塞的写者把 count 字节全部写完才返回,缓冲区满时睡眠等待读者;
+ * 非阻塞的写者或者被信号打断时返回已经写入的字节数
+ */
+static ssize_t scull_p_write_iter(struct kiocb* iocb , struct iov_iter* from){
 
+    struct file* filp = iocb->ki_filp;
     struct scull_pipe* dev = filp->private_data;
+    size_t count , done;
+    struct scull_p_shard* sh;
+    ssize_t written = 0 , retval;
+    char *rp , *wp;
     int result;
 
-    if(down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
+retry:
+    // 分片模式下写者只锁自己所在 CPU 的分片,不碰 sem 和 wlock
+    percpu_down_read(&dev->mode_sem);
+    if(dev->sharded){
+        // 迁移到别的 CPU 也不要紧,分片的锁保证正确,只是偶尔和别人争用
+        sh = per_cpu_ptr(dev->shards , raw_smp_processor_id());
+        count = iov_iter_count(from);
+        if(!(dev->packet & SCULL_P_PACKET)){
+            // 字节流: 比分片大的写入拆成几条记录,读者按时间戳顺序把它们拼回来
+            count = min(count , (size_t)(sh->mask + 1 - sizeof(struct scull_p_rec)));
+        }else if(sizeof(struct scull_p_rec) + count > sh->mask + 1){
+            // 包模式的一条记录必须整个放进一个分片
+            percpu_up_read(&dev->mode_sem);
+            return -EMSGSIZE;
+        }
+        if(!count){
+            percpu_up_read(&dev->mode_sem);
+            return written;
+        }
 
-    // 确保有空间可写入,即确保函数有可用的缓冲空间
-    result = scull_getwritespace(dev , filp);
-    if(result)
-        return result; // scull_getwritespace会调用 up(&dev->sem)
+        retval = scull_p_write_shard(dev , sh , from , count);
+        if(retval > 0){
+            written += retval;
+            scull_p_wake_reader(dev);
+            scull_p_notify(dev);
+            if(iov_iter_count(from))
+                goto retry;
+            return written;
+        }
+        if(retval != -ENOSPC)
+            return written ? written : retval;
+        if(filp->f_flags & O_NONBLOCK)
+            return written ? written : -EAGAIN;
 
-    // 有空间可用,进行数据接收
-    count = min(count , (size_t)spacefree(dev));
-    if(dev->wp >= dev->rp){
-        count = min(count , (size_t)dev->end - dev->wp);
-    }else{
-        // 数据回卷,填充到rp - 1
-        count = min(count , (size_t)(dev->rp - dev->wp - 1));
+        // 分片满了,等读者取走一些;醒来后可能换了 CPU 或者换了模式,从头再来
+        if(wait_event_interruptible(dev->outq ,
+                scull_p_shard_room(sh) >= sizeof(struct scull_p_rec) + count || !READ_ONCE(dev->sharded)))
+            return written ? written : -ERESTARTSYS;
+        goto retry;
     }
+    percpu_up_read(&dev->mode_sem);
 
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
+    // 分片模式下已经写了一部分,模式又被切换掉时 written 不为 0
+    if(scull_p_lock(dev , &dev->wlock))
+        return written ? written : -ERESTARTSYS;
 
-    if(copy_from_user(dev->wp , buf , count)){
-        up(&dev->sem);
-        return -EFAULT;
+    // 持有锁时包模式不会改变
+    if(dev->packet & SCULL_P_PACKET)
+        return scull_p_write_packet(dev , filp , from);
+
+    while(iov_iter_count(from)){
+        // 确保有空间可写入,即确保函数有可用的缓冲空间
+        result = scull_getwritespace(dev , filp , 1);
+        if(result){
+            // scull_getwritespace会调用 scull_p_unlock
+            written = written ? written : result;
+            goto out;
+        }
+
+        // wp 只有写者修改;acquire 读 rp,保证读者已经读完了要被覆盖的数据
+        wp = scull_p_wp(dev);
+        rp = scull_p_rp_acquire(dev);
+
+        // 有空间可用,进行数据接收;空闲区可能分成 wp 到 end 和 buffer 到 rp - 1 两段
+        count = min(iov_iter_count(from) , (size_t)scull_p_space(dev , rp , wp));
+
+		PDEBUG("Going to accept %li bytes to %p\n", (long)count, wp);
+
+        done = scull_p_copy_in(dev , wp , count , from);
+        if(!done){
+            scull_p_unlock(dev , &dev->wlock);
+            written = written ? written : -EFAULT;
+            goto out;
+        }
+        written += done;
+
+        wp = scull_p_advance(dev , wp , done);
+        // release: 读者看到新的 wp 时,数据已经写进缓冲区
+        scull_p_set_wp(dev , wp);
+
+        // 攒够一批才唤醒阻塞在read和select上的读者;缓冲区写满时一定够
+        scull_p_wake_reader(dev);
+    }
+
+    scull_p_unlock(dev , &dev->wlock);
+
+out:
+    // 还有空间时把唤醒传给下一个写者
+    scull_p_wake_writer(dev);
+
+    // 通知异步读取者,可能和之前的写入合并
+    if(written > 0)
+        scull_p_notify(dev);
+
+	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)written);
+	return written;
+
+}
+
+/*
+ * 不加锁: rp/wp 用 READ_ONCE 读,ring 在 RCU 里取(见 scull_p_count),结果只是一个快照,
+ * 和读写路径的检查一样.只挂到调用者关心的那个等待队列上,
+ * 只等可读的 epoll 不会因为读者取走数据而被唤醒
+ */
+static __poll_t scull_p_poll(struct file* filp , poll_table* wait){
+
+    struct scull_pipe* dev = filp->private_data;
+    __poll_t events = poll_requested_events(wait);
+    __poll_t mask = 0;
+
+    if(events & (EPOLLIN | EPOLLRDNORM))
+        poll_wait(filp , &dev->inq , wait);
+    if(events & (EPOLLOUT | EPOLLWRNORM))
+        poll_wait(filp , &dev->outq , wait);
+
+    // poll_wait 把自己挂上等待队列之后再检查,和写者的"先发布再检查有没有人睡眠"配对
+    smp_mb();
+
+    if(scull_p_readable(dev)){
+        // 可读取,和阻塞的读者一样要攒够一批
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    if(scull_p_writable(dev)){
+        // 可写入
+        mask |= EPOLLOUT | EPOLLWRNORM;
     }
 
-    dev->wp += count;
+    return mask;
 
-    if(dev->wp == dev->end){
-        dev->wp = dev->buffer; // 回卷
+}
+
+static int scull_p_fasync(int fd , struct file* filp , int mode){
+    struct scull_pipe* dev = filp->private_data;
+    // 当一个打开的文件的 FASYNC 标志被修改时,调用 fasync_helper 以便从相关的进程列表中增加和删除文件
+    return fasync_helper(fd , filp , mode , &dev->async_queue);
+}
+
+
+/*
+ * 调整一个正在使用的环形缓冲区的大小,未读的数据搬到新缓冲区的开头.
+ * 读写路径都持有 mode_sem 的读锁,拿到写锁就没有人在拷贝;再拿 sem 挡住 open/release 和 poll.
+ * 映射着的缓冲区不能换,和 scull_p_mmap 各自先声明自己(resizing / nmaps)再检查对方
+ */
+static int scull_p_resize(struct scull_pipe* dev , int size){
+    struct scull_p_ring *ring , *old;
+    char *buf , *rp;
+    int used , first , retval = 0;
+
+    // 总有一个字节空着,用来区分满和空
+    if(size < 2 || size > SCULL_P_MAX_BUFFER)
+        return -EINVAL;
+
+    ring = scull_p_alloc_ring(size);
+    if(!ring)
+        return -ENOMEM;
+    buf = scull_p_data(ring);
+
+    if(test_and_set_bit(0 , &dev->resizing)){
+        vfree(ring);
+        return -EBUSY;
+    }
+    smp_mb__after_atomic();
+    if(atomic_read(&dev->nmaps)){
+        retval = -EBUSY;
+        goto busy;
+    }
+
+    percpu_down_write(&dev->mode_sem);
+    down(&dev->sem);
+
+    rp = scull_p_rp(dev);
+    used = scull_p_used(dev , rp , scull_p_wp(dev));
+    if(used > size - 1){
+        // 放不下未读的数据
+        retval = -EBUSY;
+        goto out;
+    }
+
+    // 未读的数据可能跨过 end 回卷,分两段拷贝
+    first = min(used , (int)(dev->end - rp));
+    memcpy(buf , rp , first);
+    memcpy(buf + first , dev->buffer , used - first);
+    ring->head = used;
+
+    old = dev->ring;
+    rcu_assign_pointer(dev->ring , ring);
+    ring = old;
+    dev->buffer = buf;
+    dev->buffersize = size;
+    dev->end = buf + size;
+
+out:
+    up(&dev->sem);
+    percpu_up_write(&dev->mode_sem);
+    if(!retval){
+        // 等没有加锁的检查离开旧的 ring
+        synchronize_rcu();
+    }
+busy:
+    clear_bit(0 , &dev->resizing);
+    vfree(ring); // 旧的 ring,或者失败时没用上的新 ring
+
+    if(!retval){
+        // 空间变大,写者可能可以继续;lowat 的上限也跟着变了
+        scull_p_wake_writer(dev);
+        scull_p_wake_reader(dev);
+    }
+    return retval;
+}
+
+/*
+ * 切换包模式.和 scull_p_resize 一样先拿 mode_sem 的写锁再拿 sem;
+ * 缓冲区里还有数据时不能改变记录的格式,只改 SCULL_P_PACKET_BATCH 没有限制
+ */
+static int scull_p_set_packet(struct scull_pipe* dev , int packet){
+    int retval = 0;
+
+    if(packet & ~(SCULL_P_PACKET | SCULL_P_PACKET_BATCH))
+        return -EINVAL;
+
+    percpu_down_write(&dev->mode_sem);
+    down(&dev->sem);
+    if(((packet ^ dev->packet) & SCULL_P_PACKET) && scull_p_count(dev))
+        retval = -EBUSY;
+    else
+        dev->packet = packet;
+    up(&dev->sem);
+    percpu_up_write(&dev->mode_sem);
+    return retval;
+}
+
+/*
+ * 切换分片模式.mode_mutex 让第一次开启时的分配只做一次;
+ * 共享的环里原有的数据读者会先读完,关闭时分片里不能还有数据
+ */
+static int scull_p_set_shard(struct scull_pipe* dev , int mode){
+    int retval = 0;
+
+    if(mode < SCULL_P_SHARD_OFF || mode > SCULL_P_SHARD_TS)
+        return -EINVAL;
+
+    mutex_lock(&dev->mode_mutex);
+    if(mode && !dev->shards){
+        retval = scull_p_alloc_shards(dev);
+        if(retval)
+            goto out;
     }
 
+    percpu_down_write(&dev->mode_sem);
+    down(&dev->sem);
+    if(!mode && dev->sharded && scull_p_pending(dev) != scull_p_count(dev))
+        retval = -EBUSY;
+    else
+        dev->sharded = mode;
     up(&dev->sem);
+    percpu_up_write(&dev->mode_sem);
+
+    // 等在分片上的写者改走共享的环
+    if(!retval && !mode)
+        wake_up_interruptible_all(&dev->outq);
+out:
+    mutex_unlock(&dev->mode_mutex);
+    return retval;
+}
+
+/*
+ * 把头部页和数据区映射给用户空间,生产者和消费者直接读写环,不需要系统调用.
+ * 页来自 vmalloc,remap_vmalloc_range 一次装好所有页表,不需要 fault 回调
+ */
+static void scull_p_vma_open(struct vm_area_struct* vma){
+    struct scull_pipe* dev = vma->vm_private_data;
+    atomic_inc(&dev->nmaps);
+}
+
+static void scull_p_vma_close(struct vm_area_struct* vma){
+    struct scull_pipe* dev = vma->vm_private_data;
+    atomic_dec(&dev->nmaps);
+}
 
-    wake_up_interruptible(&dev->inq); // 阻塞在read和select上
+static const struct vm_operations_struct scull_p_vm_ops = {
+    .open  = scull_p_vma_open,
+    .close = scull_p_vma_close,
+};
 
-    // 通知异步读取者
-    if(dev->async_queue){
-        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+static int scull_p_mmap(struct file* filp , struct vm_area_struct* vma){
+    struct scull_pipe* dev = filp->private_data;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    int retval;
+
+    // 这里持有 mmap_lock,而读写路径在持锁时可能缺页,所以不能拿 sem 或 mode_sem
+    atomic_inc(&dev->nmaps);
+    smp_mb__after_atomic();
+    if(test_bit(0 , &dev->resizing)){
+        retval = -EBUSY;
+        goto fail;
     }
 
-	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
-	return count;
+    // 文件打开着,ring 一定存在;只能从头映射整个环
+    if(vma->vm_pgoff || len != PAGE_SIZE + PAGE_ALIGN(dev->buffersize)){
+        retval = -EINVAL;
+        goto fail;
+    }
 
+    retval = remap_vmalloc_range(vma , dev->ring , 0);
+    if(retval)
+        goto fail;
+
+    // fork 时不复制,子进程重新 mmap 即可
+    scull_vm_flags_set(vma , VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops = &scull_p_vm_ops;
+    vma->vm_private_data = dev;
+    return 0;
+
+fail:
+    atomic_dec(&dev->nmaps);
+    return retval;
 }
 
+/*
+ * 管道设备的 ioctl;和 scull 共用 SCULL_IOC_MAGIC,编号不重叠
+ */
+static long scull_p_ioctl(struct file* filp , unsigned int cmd , unsigned long arg){
+
+    struct scull_pipe* dev = filp->private_data;
+    struct scull_p_sigio sigio;
+    int retval = 0 , tmp;
 
+    if(_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if(_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
 
+	switch(cmd) {
+
+	  case SCULL_P_IOCTSIZE: /* Tell: arg is the value */
+		if (arg > SCULL_P_MAX_BUFFER)
+			return -EINVAL;
+		/* 和 F_SETPIPE_SZ 一样,超过 scull_p_user_max 要求 CAP_SYS_RESOURCE */
+		if (arg > scull_p_user_max && !capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+		retval = scull_p_resize(dev, arg);
+		break;
+
+	  case SCULL_P_IOCQSIZE: /* Query: return it (it's positive) */
+		return READ_ONCE(dev->buffersize);
+
+	  case SCULL_P_IOCQUSED:
+		// 持有 sem,不会和 scull_p_resize 交错
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		retval = scull_p_pending(dev);
+		up(&dev->sem);
+		break;
+
+	  case SCULL_P_IOCKICK:
+		// 用户空间直接读写映射的环之后,唤醒阻塞在另一侧的人
+		scull_p_wake_reader(dev);
+		scull_p_wake_writer(dev);
+		// 映射的读者读空之后也用它重新装上 SCULL_P_SIGIO_EDGE
+		if (scull_p_empty(dev))
+			scull_p_sigio_arm(dev);
+		else
+			scull_p_notify(dev);
+		break;
+
+	  case SCULL_P_IOCSSIGIO: /* Set: arg points to the value */
+		if (copy_from_user(&sigio, (void __user *)arg, sizeof(sigio)))
+			return -EFAULT;
+		if (sigio.mode < SCULL_P_SIGIO_EVERY || sigio.mode > SCULL_P_SIGIO_INTERVAL)
+			return -EINVAL;
+		if (sigio.interval_ms < 0 || sigio.interval_ms > 60 * MSEC_PER_SEC)
+			return -EINVAL;
+		WRITE_ONCE(dev->sigio_interval, msecs_to_jiffies(sigio.interval_ms));
+		// 第一次变成可读时总要通知
+		set_bit(0, &dev->sigio_armed);
+		WRITE_ONCE(dev->sigio, sigio.mode);
+		atomic_long_set(&dev->sigio_suppressed, 0);
+		break;
+
+	  case SCULL_P_IOCGSIGIO: /* Get: arg is pointer to result */
+		memset(&sigio, 0, sizeof(sigio));
+		sigio.mode = READ_ONCE(dev->sigio);
+		sigio.interval_ms = jiffies_to_msecs(READ_ONCE(dev->sigio_interval));
+		sigio.suppressed = atomic_long_read(&dev->sigio_suppressed);
+		if (copy_to_user((void __user *)arg, &sigio, sizeof(sigio)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_P_IOCSPACKET: /* Set: arg points to the value */
+		retval = get_user(tmp, (int __user *)arg);
+		if (retval == 0)
+			retval = scull_p_set_packet(dev, tmp);
+		break;
+
+	  case SCULL_P_IOCGPACKET: /* Get: arg is pointer to result */
+		retval = put_user(READ_ONCE(dev->packet), (int __user *)arg);
+		break;
+
+	  case SCULL_P_IOCSSHARD: /* Set: arg points to the value */
+		retval = get_user(tmp, (int __user *)arg);
+		if (retval == 0)
+			retval = scull_p_set_shard(dev, tmp);
+		break;
+
+	  case SCULL_P_IOCGSHARD: /* Get: arg is pointer to result */
+		retval = put_user(READ_ONCE(dev->sharded), (int __user *)arg);
+		break;
+
+	  case SCULL_P_IOCSLOWAT: /* Set: arg points to the value */
+		retval = get_user(tmp, (int __user *)arg);
+		if (retval)
+			break;
+		// 和 SO_RCVLOWAT 一样,0 当作 1
+		WRITE_ONCE(dev->lowat, max(tmp, 1));
+		// 门槛降低后可能已经攒够了
+		scull_p_wake_reader(dev);
+		break;
+
+	  case SCULL_P_IOCGLOWAT: /* Get: arg is pointer to result */
+		retval = put_user(READ_ONCE(dev->lowat), (int __user *)arg);
+		break;
+
+	  default:
+		return -ENOTTY;
+	}
+	return retval;
+
+}
+
+
+struct file_operations scull_pipe_fops = {
+    .owner      = THIS_MODULE,
+    .llseek     = no_llseek,
+    .read_iter  = scull_p_read_iter,
+    .write_iter = scull_p_write_iter,
+    .splice_read  = generic_file_splice_read, // 环形缓冲区 -> 管道,只拷贝一次
+    .splice_write = iter_file_splice_write,   // 管道 -> 环形缓冲区,只拷贝一次
+    .poll       = scull_p_poll,
+    .unlocked_ioctl = scull_p_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .mmap       = scull_p_mmap,
+    .open       = scull_p_open,
+    .release    = scull_p_release,
+    .fasync     = scull_p_fasync,
+};
+
+static void scull_p_setup_cdev(struct scull_pipe* dev , int index){
+    int err , devno = scull_p_devno + index;
+
+    cdev_init(&dev->cdev , &scull_pipe_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev , devno , 1);
+    if(err)
+        printk(KERN_NOTICE "Error %d adding scullpipe%d", err, index);
+}
+
+
+// 初始化管道设备,返回成功的个数
 int scull_p_init(dev_t firstdev){
 
     int i , result;
+
+    if(scull_p_lowat < 1)
+        scull_p_lowat = 1;
+    if(scull_p_buffer < 2 || scull_p_buffer > SCULL_P_MAX_BUFFER)
+        scull_p_buffer = SCULL_P_BUFFER;
+    if(scull_p_shard_size < 2 * (int)sizeof(struct scull_p_rec) || scull_p_shard_size > SCULL_P_MAX_BUFFER)
+        scull_p_shard_size = 16384;
+    if(scull_p_shard < SCULL_P_SHARD_OFF || scull_p_shard > SCULL_P_SHARD_TS)
+        scull_p_shard = SCULL_P_SHARD_OFF;
+    if(scull_p_sigio < SCULL_P_SIGIO_EVERY || scull_p_sigio > SCULL_P_SIGIO_INTERVAL)
+        scull_p_sigio = SCULL_P_SIGIO_EVERY;
+    if(scull_p_sigio_ms < 0 || scull_p_sigio_ms > 60 * MSEC_PER_SEC)
+        scull_p_sigio_ms = 10;
+
     result = register_chrdev_region(firstdev , scull_p_nr_devs , "scullp");
 
     if(result < 0){
@@ -184,13 +1443,47 @@ int scull_p_init(dev_t firstdev){
     for(i = 0; i < scull_p_nr_devs ; i++){
         init_waitqueue_head( &(scull_p_devices[i].inq) );
         init_waitqueue_head( &(scull_p_devices[i].outq) );
-        mutex_init(&scull_p_devices[i].mutex);
+        sema_init(&scull_p_devices[i].sem , 1);
+        scull_p_devices[i].lowat = scull_p_lowat;
+        scull_p_devices[i].buffersize = scull_p_buffer;
+        atomic_set(&scull_p_devices[i].nmaps , 0);
+        scull_p_devices[i].sigio = scull_p_sigio;
+        scull_p_devices[i].sigio_interval = msecs_to_jiffies(scull_p_sigio_ms);
+        scull_p_devices[i].sigio_last = jiffies - scull_p_devices[i].sigio_interval;
+        scull_p_devices[i].sigio_armed = 1;
+        atomic_long_set(&scull_p_devices[i].sigio_suppressed , 0);
+        timer_setup(&scull_p_devices[i].sigio_timer , scull_p_sigio_timer , 0);
+        mutex_init(&scull_p_devices[i].rlock);
+        mutex_init(&scull_p_devices[i].wlock);
+        mutex_init(&scull_p_devices[i].mode_mutex);
+        if(percpu_init_rwsem(&scull_p_devices[i].mode_sem))
+            goto fail;
+        if(scull_p_shard){
+            // 分配失败只是退回共享的环
+            if(scull_p_alloc_shards(scull_p_devices + i))
+                printk(KERN_NOTICE "scullpipe%d: no memory for shards\n", i);
+            else
+                scull_p_devices[i].sharded = scull_p_shard;
+        }
         scull_p_setup_cdev(scull_p_devices + i, i);
     }
 
     return scull_p_nr_devs;
+
+fail:
+    // 前 i 个设备已经注册
+    while(i--){
+        cdev_del(&scull_p_devices[i].cdev);
+        percpu_free_rwsem(&scull_p_devices[i].mode_sem);
+        scull_p_free_shards(scull_p_devices[i].shards);
+    }
+    kfree(scull_p_devices);
+    scull_p_devices = NULL;
+    unregister_chrdev_region(firstdev , scull_p_nr_devs);
+    return 0;
 }
 
+// 由 scull_cleanup_module 调用,即使什么都没有初始化也不能失败
 void scull_p_cleanup(void){
     int i;
 
@@ -200,7 +1493,10 @@ void scull_p_cleanup(void){
 
     for(i = 0; i < scull_p_nr_devs; i++ ){
         cdev_del( &scull_p_devices[i].cdev);
-        kfree(scull_p_devices[i].buffer);
+        del_timer_sync(&scull_p_devices[i].sigio_timer);
+        vfree(scull_p_devices[i].ring);
+        percpu_free_rwsem(&scull_p_devices[i].mode_sem);
+        scull_p_free_shards(scull_p_devices[i].shards);
     }
 
     kfree(scull_p_devices);
@@ -208,32 +1504,3 @@ void scull_p_cleanup(void){
     unregister_chrdev_region(scull_p_devno , scull_p_nr_devs);
     scull_p_devices = NULL;
 }
-
-
-int main(int argc , char** argv){
-    int delay = 1 , n , m = 0;
-    if(argc > 1)
-        delay = atoi(argv[1]);
-
-    fcntl(0 ,F_SETFL , fcntl(0  ,F_GETFL) | O_NONBLOCK); // stdin
-    fcntl(1 ,F_SETFL , fcntl(1  ,F_GETFL) | O_NONBLOCK); // stdout
-
-    while(1){
-        n = read(0  ,buffer , 4096);
-        if(n >= 0 )
-            m = write(1 , buffer , n);
-
-        if((n < 0 || m < 0) && (errno != EAGAIN))
-            break;        
-
-        sleep(delay);
-    }
-
-    perror(n < 0 ? "stdin" : "stdout");
-    exit(1);
-    
-}
-
-
-
-